@@ -24,8 +24,11 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "flash.h"
+#include "negcache.h"
+#include "readahead.h"
 #include "router_images.h"
 #include "socket.h"
 
@@ -37,10 +40,27 @@ static void usage(const char *prgname)
 {
 	fprintf(stderr, "Usage:\n");
 
-	fprintf(stderr, "%s interface image\tflash router with given image\n",
+	fprintf(stderr, "%s [options] interface image\tflash router with given image\n",
 		prgname);
 	fprintf(stderr, "%s -v\t\t\tprints version information\n", prgname);
 
+	fprintf(stderr, "\nOptions:\n");
+	fprintf(stderr, " -n num\t\tmaximum number of devices tracked at once (default: 4096)\n");
+	fprintf(stderr, " -g secs\tforget flashed devices after being idle for this long (default: 300)\n");
+	fprintf(stderr, " -f num\t\tignore devices after this many unknown ARP packets, 0 disables (default: 8)\n");
+	fprintf(stderr, " -i secs\tignore such devices for this long (default: 30)\n");
+#if defined(LINUX)
+	fprintf(stderr, " -r mode\treceive frames via 'read' (default), the memory mapped 'ring' or batched 'mmsg'\n");
+	fprintf(stderr, " -t mode\tsend frames via 'write' (default), the memory mapped 'ring' or batched 'mmsg'\n");
+	fprintf(stderr, " -b num\t\tnumber of frames per 'mmsg' batch (default: 16)\n");
+	fprintf(stderr, " -q\t\tbypass the qdisc layer of the kernel when sending frames\n");
+	fprintf(stderr, " -c\t\tleave UDP/TCP checksums to the kernel or NIC (PACKET_VNET_HDR)\n");
+#endif
+#if defined(LINUX) || defined(OSX)
+	fprintf(stderr, " -a MiB\t\tstream the images through a read-ahead cache of this size instead of mapping them\n");
+	fprintf(stderr, " -p\t\tpreload the images into locked memory at startup (e.g. for images on NFS)\n");
+#endif
+
 	fprintf(stderr, "\nOne or multiple images of the following type can be specified:\n");
 	router_images_print_desc();
 
@@ -51,37 +71,97 @@ static void usage(const char *prgname)
 int main(int argc, char* argv[])
 {
 	char *iface = NULL;
-	int ret = -1;
+	int ret = -1, optchar;
 	bool load_embedded = true;
 	const char *progname = "ap51-flash";
 
 	if (argc >= 1)
 		progname = argv[0];
 
-	if ((argc == 2) && (strcmp("-v", argv[1]) == 0)) {
+	while ((optchar = getopt(argc, argv, "a:b:cf:g:i:n:pqr:t:v")) != -1) {
+		switch (optchar) {
+		case 'a':
+			ret = readahead_set_size(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'b':
+			ret = socket_set_batch_size(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'c':
+			socket_set_csum_offload(true);
+			break;
+		case 'f':
+			ret = negcache_set_threshold(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'g':
+			ret = node_table_set_gc_timeout(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'i':
+			ret = negcache_set_timeout(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'n':
+			ret = node_table_set_max(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'p':
+			router_images_set_preload(true);
+			break;
+		case 'q':
+			socket_set_qdisc_bypass(true);
+			break;
+		case 'r':
+			ret = socket_set_rx_mode(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 't':
+			ret = socket_set_tx_mode(optarg);
+			if (ret < 0)
+				goto out;
+			break;
+		case 'v':
 #if defined(EMBEDDED_DESC)
-		printf("ap51-flash (%s) [embedded: %s]\n", SOURCE_VERSION,
-		       EMBEDDED_DESC);
+			printf("ap51-flash (%s) [embedded: %s]\n", SOURCE_VERSION,
+			       EMBEDDED_DESC);
 #else
-		printf("ap51-flash (%s)\n", SOURCE_VERSION);
+			printf("ap51-flash (%s)\n", SOURCE_VERSION);
 #endif
-		return 0;
+			return 0;
+		default:
+			usage(progname);
+			ret = -1;
+			goto out;
+		}
 	}
 
-	if (argc < 2) {
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
 		fprintf(stderr, "Error - no interface specified\n");
 		usage(progname);
+		ret = -1;
 		goto out;
 	}
 
-	if (strlen(argv[1]) < 3)
-		iface = socket_find_iface_by_index(argv[1]);
+	if (strlen(argv[0]) < 3)
+		iface = socket_find_iface_by_index(argv[0]);
 
 	if (!iface)
-		iface = argv[1];
+		iface = argv[0];
 
-	argc -= 2;
-	argv += 2;
+	argc -= 1;
+	argv += 1;
 
 	router_images_init();
 
@@ -21,167 +21,542 @@
 
 #include "flash.h"
 
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "compat.h"
-#include "list.h"
+#include "negcache.h"
 #include "proto.h"
+#include "readahead.h"
+#include "router_images.h"
 #include "router_tftp_client.h"
 #include "router_types.h"
 #include "socket.h"
 
+#if defined(LINUX)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
 static int running = 1;
-static struct list *node_list;
 static uint8_t our_mac[] = {0x00, 0xba, 0xbe, 0xca, 0xff, 0x00};
 
 #if defined(CLEAR_SCREEN)
 int num_nodes_flashed = 0;
 #endif
 
-#define PACKET_BUFF_LEN 2000
-#define READ_SLEEP_SEC 0
-#define READ_SLEEP_USEC 250000
+/* all timeouts in ms */
+#define MAINTAIN_INTERVAL 250
+#define NODE_RETRY_INTERVAL 250
+#define NODE_DETECT_TIMEOUT 30000
+#define NODE_GC_TIMEOUT_DEFAULT 300000
+#define NODE_GC_TIMEOUT_MAX 604800000
+
+#define NODE_TABLE_MAX_DEFAULT 4096
+#define NODE_TABLE_MAX_LIMIT 1000000
+
+static struct timer maintain_timer;
+/* the set of nodes passing the socket filter changed */
+static int filter_dirty = 1;
+static unsigned int node_gc_timeout = NODE_GC_TIMEOUT_DEFAULT;
+static unsigned int node_table_max = NODE_TABLE_MAX_DEFAULT;
+
+/* undetected nodes, least recently seen first - evicted when full */
+static struct node *node_lru_head, *node_lru_tail;
 
-static int node_list_init(void)
+/*
+ * Nodes are indexed by mac address in an open addressing hash table with
+ * linear probing. The slots carry a copy of the mac address so a lookup
+ * only dereferences the node it is looking for.
+ */
+#define NODE_TABLE_SIZE_MIN 64
+
+struct node_slot {
+	uint8_t mac_addr[ETH_ALEN];
+	struct node *node;
+};
+
+static struct node_slot *node_table;
+static unsigned int node_table_size;
+static unsigned int node_table_count;
+
+static unsigned int node_table_hash(const uint8_t *mac_addr)
 {
-	node_list = NULL;
-	return 0;
+	return mac_addr_hash(mac_addr) & (node_table_size - 1);
 }
 
-struct node *node_list_get(const uint8_t *mac_addr)
+/* slot holding @mac_addr or the free slot it would be inserted into */
+static struct node_slot *node_table_slot(const uint8_t *mac_addr)
 {
-	struct list *list;
-	struct node *node = NULL, *node_tmp;
+	unsigned int i = node_table_hash(mac_addr);
+
+	while (node_table[i].node &&
+	       memcmp(node_table[i].mac_addr, mac_addr, ETH_ALEN) != 0)
+		i = (i + 1) & (node_table_size - 1);
 
-	slist_for_each (list, node_list) {
-		node_tmp = (struct node *)list->data;
+	return &node_table[i];
+}
+
+static int node_table_resize(unsigned int size)
+{
+	struct node_slot *old_table = node_table, *slot;
+	unsigned int old_size = node_table_size, i;
 
-		if (memcmp(node_tmp->his_mac_addr, mac_addr, ETH_ALEN) != 0)
+	node_table = calloc(size, sizeof(*node_table));
+	if (!node_table) {
+		node_table = old_table;
+		return -1;
+	}
+
+	node_table_size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (!old_table[i].node)
 			continue;
 
-		node = node_tmp;
-		break;
+		slot = node_table_slot(old_table[i].mac_addr);
+		*slot = old_table[i];
 	}
 
-	if (node)
-		goto out;
+	free(old_table);
+	return 0;
+}
 
-	node = malloc(sizeof(struct node) + router_types_priv_size);
-	if (!node)
-		goto out;
+static int node_table_init(void)
+{
+	node_table = NULL;
+	node_table_size = 0;
+	node_table_count = 0;
 
-	list = malloc(sizeof(struct list));
-	if (!list)
-		goto free_node;
+	return node_table_resize(NODE_TABLE_SIZE_MIN);
+}
 
-	memset(list, 0, sizeof(struct list));
-	memset(node, 0, sizeof(struct node) + router_types_priv_size);
-	memcpy(node->his_mac_addr, mac_addr, ETH_ALEN);
-	node->image_state.fd = -1;
-	list->data = node;
-	list->next = NULL;
-	list_prepend(&node_list, list);
-	goto out;
+int node_table_set_max(const char *max)
+{
+	char *end;
+	long val;
+
+	val = strtol(max, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > NODE_TABLE_MAX_LIMIT)) {
+		fprintf(stderr, "Error - maximum number of devices has to be between 1 and %d: %s\n",
+			NODE_TABLE_MAX_LIMIT, max);
+		return -1;
+	}
 
-free_node:
-	free(node);
-	node = NULL;
-out:
-	return node;
+	node_table_max = val;
+	return 0;
+}
+
+int node_table_set_gc_timeout(const char *timeout)
+{
+	char *end;
+	long val;
+
+	val = strtol(timeout, &end, 10);
+	if ((*end != '\0') || (val < 1) ||
+	    (val > NODE_GC_TIMEOUT_MAX / 1000)) {
+		fprintf(stderr, "Error - idle timeout has to be between 1 and %d seconds: %s\n",
+			NODE_GC_TIMEOUT_MAX / 1000, timeout);
+		return -1;
+	}
+
+	node_gc_timeout = val * 1000;
+	return 0;
+}
+
+static void node_lru_unlink(struct node *node)
+{
+	if (!node->lru_linked)
+		return;
+
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		node_lru_head = node->lru_next;
+
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		node_lru_tail = node->lru_prev;
+
+	node->lru_prev = NULL;
+	node->lru_next = NULL;
+	node->lru_linked = 0;
+}
+
+static void node_lru_append(struct node *node)
+{
+	node_lru_unlink(node);
+
+	node->lru_prev = node_lru_tail;
+	if (node_lru_tail)
+		node_lru_tail->lru_next = node;
+	else
+		node_lru_head = node;
+
+	node_lru_tail = node;
+	node->lru_linked = 1;
 }
 
-static void _node_list_free(struct list *list)
+/* nodes which are allowed to send IP frames through the socket filter */
+static int node_status_filtered(enum node_status status)
 {
-	struct node *node = (struct node *)list->data;
+	switch (status) {
+	case NODE_STATUS_DETECTED:
+	case NODE_STATUS_FLASHING:
+	case NODE_STATUS_RESET_SENT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+void node_status_set(struct node *node, enum node_status status)
+{
+	if (node_status_filtered(node->status) != node_status_filtered(status))
+		filter_dirty = 1;
+
+	node->status = status;
+}
+
+static void node_free(struct node *node)
+{
+	if (node_status_filtered(node->status))
+		filter_dirty = 1;
 
+	timer_del(&node->retry_timer);
+	timer_del(&node->done_timer);
+	timer_del(&node->gc_timer);
+	timer_del(&node->tftp_timer);
+	tftp_frames_free(&node->image_state);
+	node_lru_unlink(node);
+
+	if (node->router_type && node->router_type->free)
+		node->router_type->free(node);
+
+	if (node->router_type)
+		router_images_close_path(node);
+
+	free(node->router_priv);
+	free(node->tcp_state.packet_buff);
 	free(node);
-	free(list);
 }
 
-static void node_list_free(void)
+/* remove the slot and move up entries which had to probe past it */
+static void node_table_del(struct node *node)
 {
-	struct list *list, *list_tmp;
+	unsigned int mask = node_table_size - 1, i, j, home;
+	struct node_slot *slot;
+
+	slot = node_table_slot(node->his_mac_addr);
+	if (slot->node != node)
+		return;
 
-	slist_for_each_safe (list, list_tmp, node_list)
-		_node_list_free(list);
+	i = slot - node_table;
+	j = i;
 
-	node_list = NULL;
+	while (1) {
+		j = (j + 1) & mask;
+		if (!node_table[j].node)
+			break;
+
+		home = node_table_hash(node_table[j].mac_addr);
+
+		/* home slot cyclically within (i, j] - has to stay */
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		node_table[i] = node_table[j];
+		i = j;
+	}
+
+	node_table[i].node = NULL;
+	node_table_count--;
+	node_free(node);
+
+	if ((node_table_size > NODE_TABLE_SIZE_MIN) &&
+	    (node_table_count * 8 < node_table_size))
+		node_table_resize(node_table_size / 2);
+}
+
+static void node_table_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < node_table_size; i++) {
+		if (node_table[i].node)
+			node_free(node_table[i].node);
+	}
+
+	free(node_table);
+	node_table = NULL;
+	node_table_size = 0;
+	node_table_count = 0;
+	node_lru_head = NULL;
+	node_lru_tail = NULL;
+}
+
+/* keep contacting detected devices which are supposed to talk to us */
+static void node_retry(void *data)
+{
+	struct node *node = data;
+
+	if (node->status != NODE_STATUS_DETECTED)
+		return;
+
+	switch (node->flash_mode) {
+	case FLASH_MODE_TFTP_SERVER:
+		tftp_init_upload(node);
+		break;
+	case FLASH_MODE_REDBOOT:
+		telnet_handle_connection(node);
+		break;
+	case FLASH_MODE_TFTP_CLIENT:
+		/* ignored; handled in handle_udp_packet */
+		return;
+	case FLASH_MODE_UKNOWN:
+		fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: Error, flash mode unknown.\n",
+			node->his_mac_addr[0], node->his_mac_addr[1],
+			node->his_mac_addr[2], node->his_mac_addr[3],
+			node->his_mac_addr[4], node->his_mac_addr[5]);
+		return;
+	}
+
+	timer_add(&node->retry_timer, NODE_RETRY_INTERVAL);
+}
+
+static void node_flash_done(void *data)
+{
+	struct node *node = data;
+
+	if (node->status != NODE_STATUS_FINISHED)
+		return;
+
+	fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: flash complete. Device ready to unplug.\n",
+		node->his_mac_addr[0], node->his_mac_addr[1],
+		node->his_mac_addr[2], node->his_mac_addr[3],
+		node->his_mac_addr[4], node->his_mac_addr[5],
+		node->router_type->desc);
+	node_status_set(node, NODE_STATUS_REBOOTED);
+
+	/* MR500 devices all have the same mac address during flash .. :( */
+	if (node->router_type == &mr500) {
+		node_status_set(node, NODE_STATUS_UNKNOWN);
+		node->flash_mode = FLASH_MODE_UKNOWN;
+		timer_del(&node->tftp_timer);
+		tftp_frames_free(&node->image_state);
+		memset((void *)&node->image_state, 0,
+		       sizeof(struct image_state));
+		node->image_state.fd = -1;
+	}
+#if defined(CLEAR_SCREEN)
+	num_nodes_flashed++;
+#endif
+}
+
+/* forget nodes which didn't send anything for a while */
+static void node_gc(void *data)
+{
+	struct node *node = data;
+	unsigned int timeout;
+	uint64_t idle;
+
+	switch (node->status) {
+	case NODE_STATUS_UNKNOWN:
+	case NODE_STATUS_DETECTING:
+		timeout = NODE_DETECT_TIMEOUT;
+		break;
+	case NODE_STATUS_REBOOTED:
+	case NODE_STATUS_NO_FLASH:
+		timeout = node_gc_timeout;
+		break;
+	default:
+		/* still busy */
+		timer_add(&node->gc_timer, node_gc_timeout);
+		return;
+	}
+
+	idle = timer_now() - node->last_seen;
+	if (idle < timeout) {
+		timer_add(&node->gc_timer, timeout - idle);
+		return;
+	}
+
+	node_table_del(node);
 }
 
-static void node_list_maintain(void)
+/* make room by dropping the least recently seen undetected node */
+static int node_table_evict(void)
 {
-	struct list *list, *list_tmp;
 	struct node *node;
-	int ret;
 
-	slist_for_each_safe (list, list_tmp, node_list) {
-		node = (struct node *)list->data;
+	while (node_lru_head) {
+		node = node_lru_head;
 
 		switch (node->status) {
 		case NODE_STATUS_UNKNOWN:
-		case NODE_STATUS_RESET_SENT:
 		case NODE_STATUS_DETECTING:
-			/* ignored */
-			break;
-		case NODE_STATUS_DETECTED:
-			switch (node->flash_mode) {
-			case FLASH_MODE_TFTP_SERVER:
-				tftp_init_upload(node);
-				break;
-			case FLASH_MODE_REDBOOT:
-				telnet_handle_connection(node);
-				break;
-			case FLASH_MODE_TFTP_CLIENT:
-				/* ignored; handled in handle_udp_packet */
-				break;
-			case FLASH_MODE_UKNOWN:
-				fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: Error, flash mode unknown.\n",
-					node->his_mac_addr[0], node->his_mac_addr[1],
-					node->his_mac_addr[2], node->his_mac_addr[3],
-					node->his_mac_addr[4], node->his_mac_addr[5]);
-				break;
-			}
-			break;
-		case NODE_STATUS_FLASHING:
-			/* if (node->flash_mode == FLASH_MODE_REDBOOT)
-				telnet_keep_alive(node); */
-			break;
-		case NODE_STATUS_FINISHED:
-			if (node->flash_mode != FLASH_MODE_TFTP_CLIENT)
-				break;
-
-			ret = tftp_client_flash_completed(node);
-			if (ret == 0)
-				break;
-
-			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: flash complete. Device ready to unplug.\n",
-				node->his_mac_addr[0], node->his_mac_addr[1],
-				node->his_mac_addr[2], node->his_mac_addr[3],
-				node->his_mac_addr[4], node->his_mac_addr[5],
-				node->router_type->desc);
-			node->status = NODE_STATUS_REBOOTED;
-
-			/* MR500 devices all have the same mac address during flash .. :( */
-			if (node->router_type == &mr500) {
-				node->status = NODE_STATUS_UNKNOWN;
-				node->flash_mode = FLASH_MODE_UKNOWN;
-				memset((void *)&node->image_state, 0,
-				       sizeof(struct image_state));
-				node->image_state.fd = -1;
-			}
-#if defined(CLEAR_SCREEN)
-			num_nodes_flashed++;
-#endif
-			break;
-		case NODE_STATUS_REBOOTED:
-		case NODE_STATUS_NO_FLASH:
-			/* check timeout and call _node_list_free(list); */
+			node_table_del(node);
+			return 0;
+		default:
+			/* detected since it was seen last */
+			node_lru_unlink(node);
 			break;
 		}
 	}
+
+	return -1;
+}
+
+/* a frame from @node was received */
+void node_touch(struct node *node)
+{
+	node->last_seen = timer_now();
+
+	switch (node->status) {
+	case NODE_STATUS_UNKNOWN:
+	case NODE_STATUS_DETECTING:
+		node_lru_append(node);
+		break;
+	default:
+		node_lru_unlink(node);
+		break;
+	}
+}
+
+struct node *node_table_find(const uint8_t *mac_addr)
+{
+	return node_table_slot(mac_addr)->node;
+}
+
+/* like node_table_find() but adds a new node for unknown mac addresses */
+struct node *node_table_get(const uint8_t *mac_addr)
+{
+	struct node_slot *slot;
+	struct node *node;
+
+	slot = node_table_slot(mac_addr);
+	if (slot->node)
+		return slot->node;
+
+	if ((node_table_count >= node_table_max) && (node_table_evict() < 0))
+		return NULL;
+
+	/* keep the table at most half full for short probe sequences */
+	if ((node_table_count + 1) * 2 > node_table_size) {
+		if (node_table_resize(node_table_size * 2) < 0 &&
+		    node_table_count + 1 >= node_table_size)
+			return NULL;
+	}
+
+	slot = node_table_slot(mac_addr);
+
+	node = malloc(sizeof(struct node) + router_types_detect_priv_size);
+	if (!node)
+		return NULL;
+
+	memset(node, 0, sizeof(struct node) + router_types_detect_priv_size);
+	memcpy(node->his_mac_addr, mac_addr, ETH_ALEN);
+	node->image_state.fd = -1;
+	timer_init(&node->retry_timer, node_retry, node);
+	timer_init(&node->done_timer, node_flash_done, node);
+	timer_init(&node->gc_timer, node_gc, node);
+	timer_init(&node->tftp_timer, tftp_timeout, node);
+	node->last_seen = timer_now();
+	timer_add(&node->gc_timer, NODE_DETECT_TIMEOUT);
+
+	memcpy(slot->mac_addr, mac_addr, ETH_ALEN);
+	slot->node = node;
+	node_table_count++;
+
+	return node;
+}
+
+/* start talking to a freshly detected device */
+void node_detected(struct node *node)
+{
+	/* let its IP frames pass before it starts talking to us */
+	node_table_filter_update();
+	timer_add(&node->retry_timer, 0);
+}
+
+/* @node sent an ARP packet which matched none of the router types */
+void node_detect_failed(struct node *node)
+{
+	node->detect_fails++;
+	if (!negcache_threshold_reached(node->detect_fails))
+		return;
+
+	/* drop its frames from now on without tracking it as node */
+	negcache_add(node->his_mac_addr);
+	node_table_del(node);
+}
+
+/* wait @timeout ms for the device to write the image before reporting it */
+void node_flash_wait(struct node *node, unsigned int timeout)
+{
+	timer_add(&node->done_timer, timeout);
+}
+
+static void node_table_maintain(void *data __attribute__((unused)))
+{
+	router_types_detect_pre(our_mac);
+	node_table_filter_update();
+
+	timer_add(&maintain_timer, MAINTAIN_INTERVAL);
+}
+
+/**
+ * node_table_filter_update() - sync the kernel socket filter with the nodes
+ *
+ * Only nodes which are being flashed are allowed to send IP frames. The
+ * filter is only rebuilt after that set changed (see node_status_set()).
+ */
+void node_table_filter_update(void)
+{
+	static uint8_t macs[(PROTO_FILTER_MACS_MAX + 1) * ETH_ALEN];
+	static unsigned int num_macs_filtered;
+	static int filter_attached;
+	uint8_t macs_new[sizeof(macs)];
+	unsigned int num_macs = 0, i;
+	struct node *node;
+
+	if (!filter_dirty)
+		return;
+
+	filter_dirty = 0;
+
+	for (i = 0; i < node_table_size; i++) {
+		node = node_table[i].node;
+		if (!node)
+			continue;
+
+		if (!node_status_filtered(node->status))
+			continue;
+
+		/* the filter accepts every source beyond this limit */
+		if (num_macs > PROTO_FILTER_MACS_MAX)
+			break;
+
+		memcpy(macs_new + num_macs * ETH_ALEN, node->his_mac_addr,
+		       ETH_ALEN);
+		num_macs++;
+	}
+
+	if (filter_attached && num_macs == num_macs_filtered &&
+	    memcmp(macs, macs_new, num_macs * ETH_ALEN) == 0)
+		return;
+
+	memcpy(macs, macs_new, num_macs * ETH_ALEN);
+	num_macs_filtered = num_macs;
+	filter_attached = 1;
+
+	proto_filter_update(our_mac, macs, num_macs);
 }
 
 void our_mac_set(struct node *node)
@@ -192,6 +567,174 @@ void our_mac_set(struct node *node)
 	our_mac[5]++;
 }
 
+#if defined(LINUX)
+#define EPOLL_EVENTS_MAX 4
+
+/* wake up when the timer wheel has work to do */
+static int flash_timer_arm(int timer_fd, uint64_t *armed)
+{
+	struct itimerspec timer_spec;
+	uint64_t next;
+	int ret;
+
+	next = timer_next();
+	if (next == *armed)
+		return 0;
+
+	memset(&timer_spec, 0, sizeof(timer_spec));
+	if (next != TIMER_NONE) {
+		timer_spec.it_value.tv_sec = next / 1000;
+		timer_spec.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+
+	ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer_spec, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't arm timer: %s\n",
+			strerror(errno));
+		return ret;
+	}
+
+	*armed = next;
+	return 0;
+}
+
+static int flash_epoll_add(int epoll_fd, int fd)
+{
+	struct epoll_event event;
+	int ret;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	if (ret < 0)
+		fprintf(stderr, "Error - can't watch file descriptor: %s\n",
+			strerror(errno));
+
+	return ret;
+}
+
+static void flash_signal_handle(int signal_fd)
+{
+	struct signalfd_siginfo siginfo;
+
+	while (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+		switch (siginfo.ssi_signo) {
+		case SIGINT:
+		case SIGTERM:
+			running = 0;
+			break;
+		case SIGUSR1:
+			socket_print_stats();
+			break;
+		}
+	}
+}
+
+/**
+ * flash_loop() - handle frames as they arrive and node timers on time
+ *
+ * Frames, the next deadline of the timer wheel and signals are all waited
+ * for with one epoll_wait() call. Timers therefore fire on schedule no
+ * matter how busy the link is.
+ */
+static int flash_loop(void)
+{
+	struct epoll_event events[EPOLL_EVENTS_MAX];
+	int epoll_fd, timer_fd, signal_fd, sock_fd;
+	int ret = -1, i, num_events;
+	uint64_t expirations, armed = TIMER_NONE;
+	sigset_t sigmask;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+
+	ret = sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't block signals: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	ret = -1;
+	signal_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		fprintf(stderr, "Error - can't create signalfd: %s\n",
+			strerror(errno));
+		goto unblock;
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		fprintf(stderr, "Error - can't create timerfd: %s\n",
+			strerror(errno));
+		goto close_signal;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "Error - can't create epoll instance: %s\n",
+			strerror(errno));
+		goto close_timer;
+	}
+
+	sock_fd = socket_fd();
+	if ((flash_epoll_add(epoll_fd, sock_fd) < 0) ||
+	    (flash_epoll_add(epoll_fd, timer_fd) < 0) ||
+	    (flash_epoll_add(epoll_fd, signal_fd) < 0))
+		goto close_epoll;
+
+	while (running) {
+		if (flash_timer_arm(timer_fd, &armed) < 0)
+			goto close_epoll;
+
+		num_events = epoll_wait(epoll_fd, events, EPOLL_EVENTS_MAX, -1);
+		if (num_events < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Error waiting for events: %s\n",
+				strerror(errno));
+			goto close_epoll;
+		}
+
+		for (i = 0; i < num_events; i++) {
+			if (events[i].data.fd == sock_fd) {
+				socket_drain(handle_eth_packet);
+			} else if (events[i].data.fd == timer_fd) {
+				if (read(timer_fd, &expirations,
+					 sizeof(expirations)) < 0)
+					continue;
+
+				armed = TIMER_NONE;
+			} else if (events[i].data.fd == signal_fd) {
+				flash_signal_handle(signal_fd);
+			}
+		}
+
+		timer_run();
+
+		/* one kick for all frames queued in this iteration */
+		socket_flush();
+	}
+
+	ret = 0;
+
+close_epoll:
+	close(epoll_fd);
+close_timer:
+	close(timer_fd);
+close_signal:
+	close(signal_fd);
+unblock:
+	sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+out:
+	return ret;
+}
+#else
 static void sig_handler(int signal)
 {
 	switch (signal) {
@@ -202,67 +745,81 @@ static void sig_handler(int signal)
 	}
 }
 
+static int flash_loop(void)
+{
+	int sleep_sec, sleep_usec;
+	uint64_t next, now;
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	while (running) {
+		next = timer_next();
+		now = timer_now();
+
+		if (next == TIMER_NONE)
+			next = now + MAINTAIN_INTERVAL;
+		else if (next < now)
+			next = now;
+
+		sleep_sec = (next - now) / 1000;
+		sleep_usec = ((next - now) % 1000) * 1000;
+
+		socket_read(handle_eth_packet, &sleep_sec, &sleep_usec);
+		timer_run();
+
+		/* one kick for all frames queued in this iteration */
+		socket_flush();
+	}
+
+	return 0;
+}
+#endif
+
 int flash_start(const char *iface)
 {
-	char *packet_buff;
-	int ret, sleep_sec, sleep_usec;
+	int ret;
 
 	ret = socket_open(iface);
 	if (ret < 0)
 		goto out;
 
-	ret = node_list_init();
+	timer_wheel_init();
+
+	ret = node_table_init();
 	if (ret < 0)
 		goto sock_close;
 
-	packet_buff = malloc(PACKET_BUFF_LEN);
-	if (!packet_buff)
-		goto list_free;
-
 	ret = proto_init();
 	if (ret < 0)
-		goto pack_free;
+		goto table_free;
 
 	ret = router_types_init();
 	if (ret < 0)
 		goto proto_free;
 
-	signal(SIGINT, sig_handler);
-	signal(SIGTERM, sig_handler);
-
-	sleep_sec = READ_SLEEP_SEC;
-	sleep_usec = READ_SLEEP_USEC;
+	timer_init(&maintain_timer, node_table_maintain, NULL);
+	timer_add(&maintain_timer, 0);
 
-	while (running) {
-		ret = socket_read(packet_buff, PACKET_BUFF_LEN, &sleep_sec,
-				  &sleep_usec);
-
-		if (ret == 0) {
-			router_types_detect_pre(our_mac);
-			node_list_maintain();
-		}
-
-		if (ret <= 0)
-			goto reset_sleep;
-
-		handle_eth_packet(packet_buff, ret);
-		continue;
-
-reset_sleep:
-		sleep_sec = READ_SLEEP_SEC;
-		sleep_usec = READ_SLEEP_USEC;
-	}
+	ret = flash_loop();
+	if (ret < 0)
+		goto types_free;
 
+	socket_print_stats();
+	negcache_print_stats();
+	proto_print_stats();
+	readahead_print_stats();
 	ret = 0;
 
+types_free:
+	router_types_free();
 proto_free:
 	proto_free();
-pack_free:
-	free(packet_buff);
-list_free:
-	node_list_free();
+table_free:
+	node_table_free();
 sock_close:
 	socket_close(iface);
 out:
+	readahead_exit();
 	return ret;
 }
@@ -25,6 +25,7 @@
 #include <stdint.h>
 
 #include "proto.h"
+#include "timer.h"
 
 enum flash_mode {
 	FLASH_MODE_UKNOWN,
@@ -54,6 +55,21 @@ struct node {
 	struct router_type *router_type;
 	struct image_state image_state;
 	struct tcp_state tcp_state;
+	struct frame_templates templates;
+	/* WRQ / SYN resends until the device answers */
+	struct timer retry_timer;
+	/* device is writing the received image to its flash */
+	struct timer done_timer;
+	/* frees the node once it stayed idle for too long */
+	struct timer gc_timer;
+	/* resends TFTP data the device did not ack in time */
+	struct timer tftp_timer;
+	uint64_t last_seen;
+	struct node *lru_prev;
+	struct node *lru_next;
+	unsigned char lru_linked:1;
+	/* ARP packets no router type was interested in */
+	unsigned int detect_fails;
 	void *router_priv;
 	/* priv declarations are added at runtime */
 };
@@ -62,7 +78,16 @@ struct node {
 extern int num_nodes_flashed;
 #endif
 
-struct node *node_list_get(const uint8_t *mac_addr);
+int node_table_set_max(const char *max);
+int node_table_set_gc_timeout(const char *timeout);
+struct node *node_table_find(const uint8_t *mac_addr);
+struct node *node_table_get(const uint8_t *mac_addr);
+void node_table_filter_update(void);
+void node_status_set(struct node *node, enum node_status status);
+void node_touch(struct node *node);
+void node_detected(struct node *node);
+void node_detect_failed(struct node *node);
+void node_flash_wait(struct node *node, unsigned int timeout);
 void our_mac_set(struct node *node);
 int flash_start(const char *iface);
 
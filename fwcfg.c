@@ -47,7 +47,31 @@ static void rtrim(char *s)
 	}
 }
 
+/* the files are requested in the order fwupgrade.cfg lists them */
+static int fwcfg_plan_add(struct file_info *cfg_info,
+			  struct file_info *file_info)
+{
+	struct file_info **files;
+
+	files = realloc(cfg_info->fwcfg_files,
+			(cfg_info->fwcfg_file_count + 1) * sizeof(*files));
+	if (!files)
+		return -1;
+
+	files[cfg_info->fwcfg_file_count++] = file_info;
+	cfg_info->fwcfg_files = files;
+	return 0;
+}
+
+static void fwcfg_plan_free(struct file_info *cfg_info)
+{
+	free(cfg_info->fwcfg_files);
+	cfg_info->fwcfg_files = NULL;
+	cfg_info->fwcfg_file_count = 0;
+}
+
 static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
+				      struct file_info *cfg_info,
 				      char *content)
 {
 	char *line, *str_start, *saveptr;
@@ -57,6 +81,8 @@ static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
 	const char *section = NULL;
 	struct file_info *file_info;
 
+	fwcfg_plan_free(cfg_info);
+
 	/* parse */
 	for (str_start = content; ; str_start = NULL) {
 		line = strtok_r(str_start, "\n", &saveptr);
@@ -69,7 +95,7 @@ static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
 		if (!section && line[0] != '[') {
 			fprintf(stderr, "Found line before section: %s\n",
 				line);
-			return 0;
+			goto err;
 		}
 
 		if (line[0] == '[') {
@@ -80,7 +106,7 @@ static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
 				fprintf(stderr,
 					"Found section line without delimiter: %s\n",
 					line);
-				return 0;
+				goto err;
 			}
 
 			line[line_len - 1] = '\0';
@@ -94,7 +120,7 @@ static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
 				fprintf(stderr,
 					"Found type=value line without '=': %s\n",
 					line);
-				return 0;
+				goto err;
 			}
 
 			tv_delim[0] = '\0';
@@ -109,7 +135,13 @@ static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
 				fprintf(stderr,
 					"Failed to find file %s referenced in fwupgrade.cfg\n",
 					value);
-				return 0;
+				goto err;
+			}
+
+			if (fwcfg_plan_add(cfg_info, file_info) < 0) {
+				fprintf(stderr, "Error - can't allocate the file list of '%s'\n",
+					cfg_info->file_name);
+				goto err;
 			}
 
 			size += file_info->file_size;
@@ -117,10 +149,14 @@ static unsigned int fwcfg_parse_sizes(struct router_image *router_image,
 	}
 
 	return size;
+
+err:
+	fwcfg_plan_free(cfg_info);
+	return 0;
 }
 
 unsigned int fwupgrade_cfg_read_sizes(struct router_image *router_image,
-				      const struct file_info *file_info)
+				      struct file_info *file_info)
 {
 	int fd = -1;
 	int size = 0;
@@ -172,7 +208,7 @@ unsigned int fwupgrade_cfg_read_sizes(struct router_image *router_image,
 	}
 
 	dst[read_len] = '\0';
-	size = fwcfg_parse_sizes(router_image, dst);
+	size = fwcfg_parse_sizes(router_image, file_info, dst);
 
 out:
 	if (fd >= 0)
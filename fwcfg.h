@@ -26,6 +26,6 @@ struct file_info;
 struct router_image;
 
 unsigned int fwupgrade_cfg_read_sizes(struct router_image *router_image,
-				      const struct file_info *file_info);
+				      struct file_info *file_info);
 
 #endif /* __AP51_FLASH_FWCFG_H__ */
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) Marek Lindner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ * License-Filename: LICENSES/preferred/GPL-3.0
+ */
+
+#include "negcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "proto.h"
+#include "timer.h"
+
+#define NEGCACHE_THRESHOLD_DEFAULT 8
+#define NEGCACHE_THRESHOLD_MAX 1000
+#define NEGCACHE_TIMEOUT_DEFAULT 30000
+#define NEGCACHE_TIMEOUT_MAX 86400000
+
+/*
+ * Mac addresses which repeatedly sent ARP packets none of the router types
+ * is interested in are no flash target. Their frames are dropped before a
+ * node is looked up or even created for them.
+ *
+ * The cache is set associative: a mac address can only be stored in one of
+ * the NEGCACHE_WAYS entries of its bucket (a single cache line). When the
+ * bucket is full the entry expiring first is replaced - losing an entry
+ * only costs another round of failed detections.
+ */
+#define NEGCACHE_BUCKETS 1024
+#define NEGCACHE_WAYS 4
+
+struct negcache_entry {
+	uint8_t mac_addr[ETH_ALEN];
+	/* 0 marks an unused entry */
+	uint64_t expires;
+};
+
+static struct negcache_entry negcache[NEGCACHE_BUCKETS][NEGCACHE_WAYS];
+static unsigned int negcache_threshold = NEGCACHE_THRESHOLD_DEFAULT;
+static unsigned int negcache_timeout = NEGCACHE_TIMEOUT_DEFAULT;
+
+static struct {
+	unsigned long added;
+	unsigned long replaced;
+	unsigned long expired;
+	unsigned long dropped;
+} negcache_stats;
+
+int negcache_set_threshold(const char *threshold)
+{
+	char *end;
+	long val;
+
+	val = strtol(threshold, &end, 10);
+	if ((*end != '\0') || (val < 0) || (val > NEGCACHE_THRESHOLD_MAX)) {
+		fprintf(stderr, "Error - number of failed detections has to be between 0 and %d: %s\n",
+			NEGCACHE_THRESHOLD_MAX, threshold);
+		return -1;
+	}
+
+	negcache_threshold = val;
+	return 0;
+}
+
+int negcache_set_timeout(const char *timeout)
+{
+	char *end;
+	long val;
+
+	val = strtol(timeout, &end, 10);
+	if ((*end != '\0') || (val < 1) ||
+	    (val > NEGCACHE_TIMEOUT_MAX / 1000)) {
+		fprintf(stderr, "Error - ignore timeout has to be between 1 and %d seconds: %s\n",
+			NEGCACHE_TIMEOUT_MAX / 1000, timeout);
+		return -1;
+	}
+
+	negcache_timeout = val * 1000;
+	return 0;
+}
+
+/* a threshold of 0 disables the cache */
+bool negcache_threshold_reached(unsigned int fails)
+{
+	return negcache_threshold && fails >= negcache_threshold;
+}
+
+static struct negcache_entry *negcache_bucket(const uint8_t *mac_addr)
+{
+	return negcache[mac_addr_hash(mac_addr) & (NEGCACHE_BUCKETS - 1)];
+}
+
+void negcache_add(const uint8_t *mac_addr)
+{
+	struct negcache_entry *bucket, *entry;
+	uint64_t now = timer_now();
+	unsigned int i;
+
+	bucket = negcache_bucket(mac_addr);
+	entry = &bucket[0];
+
+	for (i = 0; i < NEGCACHE_WAYS; i++) {
+		if (!bucket[i].expires ||
+		    memcmp(bucket[i].mac_addr, mac_addr, ETH_ALEN) == 0) {
+			entry = &bucket[i];
+			break;
+		}
+
+		if (bucket[i].expires < entry->expires)
+			entry = &bucket[i];
+	}
+
+	if (i == NEGCACHE_WAYS && entry->expires > now)
+		negcache_stats.replaced++;
+
+	memcpy(entry->mac_addr, mac_addr, ETH_ALEN);
+	entry->expires = now + negcache_timeout;
+	negcache_stats.added++;
+}
+
+/**
+ * negcache_find() - check whether frames of a mac address can be dropped
+ * @mac_addr: source mac address of the received frame
+ *
+ * Return: true if the mac address is known not to be a flash target
+ */
+bool negcache_find(const uint8_t *mac_addr)
+{
+	struct negcache_entry *bucket;
+	unsigned int i;
+
+	if (!negcache_threshold || !negcache_stats.added)
+		return false;
+
+	bucket = negcache_bucket(mac_addr);
+
+	for (i = 0; i < NEGCACHE_WAYS; i++) {
+		if (!bucket[i].expires)
+			continue;
+
+		if (memcmp(bucket[i].mac_addr, mac_addr, ETH_ALEN) != 0)
+			continue;
+
+		if (bucket[i].expires <= timer_now()) {
+			bucket[i].expires = 0;
+			negcache_stats.expired++;
+			return false;
+		}
+
+		negcache_stats.dropped++;
+		return true;
+	}
+
+	return false;
+}
+
+void negcache_print_stats(void)
+{
+	if (!negcache_stats.added)
+		return;
+
+	fprintf(stderr, "Ignored: %lu frames of devices which are no flash target (added: %lu, expired: %lu, replaced: %lu)\n",
+		negcache_stats.dropped, negcache_stats.added,
+		negcache_stats.expired, negcache_stats.replaced);
+}
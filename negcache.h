@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) Marek Lindner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ * License-Filename: LICENSES/preferred/GPL-3.0
+ */
+
+#ifndef __AP51_FLASH_NEGCACHE_H__
+#define __AP51_FLASH_NEGCACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+int negcache_set_threshold(const char *threshold);
+int negcache_set_timeout(const char *timeout);
+bool negcache_threshold_reached(unsigned int fails);
+void negcache_add(const uint8_t *mac_addr);
+bool negcache_find(const uint8_t *mac_addr);
+void negcache_print_stats(void);
+
+#endif /* __AP51_FLASH_NEGCACHE_H__ */
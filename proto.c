@@ -21,6 +21,7 @@
 
 #include "proto.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +30,7 @@
 #include "ap51-flash.h"
 #include "compat.h"
 #include "flash.h"
+#include "negcache.h"
 #include "router_images.h"
 #include "router_redboot.h"
 #include "router_tftp_client.h"
@@ -40,6 +42,31 @@
 #define REDBOOT_TELNET_DPORT 9000
 
 #define TFTP_PAYLOAD_SIZE 512
+/* block size limits of RFC 2348 */
+#define TFTP_BLKSIZE_MIN 8
+#define TFTP_BLKSIZE_MAX 65464
+/* blocks sent in a burst per ack - larger windows are capped */
+#define TFTP_WINDOWSIZE_MAX 64
+/* window size asked for when uploading to a TFTP server */
+#define TFTP_WINDOWSIZE_WRQ 8
+/* retransmission timeout of unacked DATA blocks (ms) */
+#define TFTP_RTO_INITIAL 250
+#define TFTP_RTO_MIN 10
+#define TFTP_RTO_MAX 3000
+/* consecutive timeouts before leaving it to the device to recover */
+#define TFTP_TIMEOUTS_MAX 8
+/* headers of a TFTP DATA frame in front of the payload */
+#define TFTP_DATA_HLEN (ETH_HLEN + sizeof(struct iphdr) + \
+			sizeof(struct udphdr) + 4)
+/* room for the options of an OACK behind its opcode */
+#define TFTP_OACK_MAX (ETH_DATA_LEN - sizeof(struct iphdr) - \
+		       sizeof(struct udphdr) - 2)
+
+enum tftp_option {
+	TFTP_OPTION_BLKSIZE = 1 << 0,
+	TFTP_OPTION_WINDOWSIZE = 1 << 1,
+	TFTP_OPTION_TSIZE = 1 << 2,
+};
 
 enum tcp_packet_type {
 	TCP_SYN,
@@ -53,129 +80,224 @@ enum tcp_packet_type {
 			 sizeof(struct tcphdr))
 
 static char *out_packet_buff;
-static struct ether_header *out_ethhdr;
-static struct ether_arp *out_arphdr;
 static struct iphdr *out_iphdr;
 static struct udphdr *out_udphdr;
 static char *out_tftp_data;
 
+static unsigned long tftp_timeouts;
+static unsigned long tftp_blocks_resent;
+static unsigned long tftp_dup_acks;
+static unsigned long tftp_dup_rrqs;
+
+
+/* point the out_* headers to the buffer the next frame is built in */
+static void out_packet_buff_get(void)
+{
+	out_packet_buff = socket_tx_buff_get();
+	out_iphdr = (struct iphdr *)(out_packet_buff + ETH_HLEN);
+	out_udphdr = (struct udphdr *)(out_packet_buff + ETH_HLEN + sizeof(struct iphdr));
+	out_tftp_data = (void *)(out_packet_buff + ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr));
+}
 
+/*
+ * Sums up native byte order words 32 bits at a time and folds the carries
+ * once at the end - swapping the result is the same as summing up network
+ * byte order words (RFC 1071)
+ */
 static unsigned short chksum(unsigned short sum, const unsigned char *data,
 			     unsigned short len)
 {
-	unsigned short t;
-	const unsigned char *dataptr, *last_byte;
+	uint64_t acc = 0;
+	uint32_t w32;
+	uint16_t w16;
+
+	while (len >= 8) {
+		memcpy(&w32, data, sizeof(w32));
+		acc += w32;
+		memcpy(&w32, data + 4, sizeof(w32));
+		acc += w32;
+		data += 8;
+		len -= 8;
+	}
 
-	dataptr = data;
-	last_byte = data + len - 1;
+	if (len >= 4) {
+		memcpy(&w32, data, sizeof(w32));
+		acc += w32;
+		data += 4;
+		len -= 4;
+	}
 
-	while (dataptr < last_byte) {
-		t = (dataptr[0] << 8) + dataptr[1];
-		sum += t;
-		if(sum < t)
-			sum++;
-		dataptr += 2;
+	if (len >= 2) {
+		memcpy(&w16, data, sizeof(w16));
+		acc += w16;
+		data += 2;
+		len -= 2;
 	}
 
-	if (dataptr == last_byte) {
-		t = (dataptr[0] << 8) + 0;
-		sum += t;
-		if(sum < t)
-			sum++;
+	/* odd length - padded with a zero byte */
+	if (len) {
+		w16 = 0;
+		memcpy(&w16, data, 1);
+		acc += w16;
 	}
 
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffff) + (acc >> 16);
+	acc = (acc & 0xffff) + (acc >> 16);
+	acc = (acc & 0xffff) + (acc >> 16);
+
+	w16 = ntohs((uint16_t)acc);
+	sum += w16;
+	if (sum < w16)
+		sum++;
+
 	return sum;
 }
 
-static void arp_init(const uint8_t *src_mac, const uint8_t *dst_mac,
-		     unsigned int src_ip, unsigned int dst_ip,
-		     unsigned short arp_type)
+static void arp_init(char *buff, const uint8_t *src_mac,
+		     const uint8_t *dst_mac, unsigned int src_ip,
+		     unsigned int dst_ip, unsigned short arp_type)
 {
-	memcpy(out_ethhdr->ether_shost, src_mac, ETH_ALEN);
-	memcpy(out_ethhdr->ether_dhost, dst_mac, ETH_ALEN);
-	out_ethhdr->ether_type = htons(ETH_P_ARP);
-
-	out_arphdr->ea_hdr.ar_hrd = htons(0x0001); /* ethernet */
-	out_arphdr->ea_hdr.ar_pro = htons(ETH_P_IP); /* IPv4 */
-	out_arphdr->ea_hdr.ar_hln = ETH_ALEN;
-	out_arphdr->ea_hdr.ar_pln = 4; /* IPv4 addr len */
-
-	out_arphdr->ea_hdr.ar_op = htons(arp_type);
-	memcpy(out_arphdr->arp_sha, src_mac, ETH_ALEN);
-	*((unsigned int *)out_arphdr->arp_spa) = src_ip;
-	*((unsigned int *)out_arphdr->arp_tpa) = dst_ip;
+	struct ether_header *ethhdr = (struct ether_header *)buff;
+	struct ether_arp *arphdr = (struct ether_arp *)(buff + ETH_HLEN);
+
+	memcpy(ethhdr->ether_shost, src_mac, ETH_ALEN);
+	memcpy(ethhdr->ether_dhost, dst_mac, ETH_ALEN);
+	ethhdr->ether_type = htons(ETH_P_ARP);
+
+	arphdr->ea_hdr.ar_hrd = htons(0x0001); /* ethernet */
+	arphdr->ea_hdr.ar_pro = htons(ETH_P_IP); /* IPv4 */
+	arphdr->ea_hdr.ar_hln = ETH_ALEN;
+	arphdr->ea_hdr.ar_pln = 4; /* IPv4 addr len */
+
+	arphdr->ea_hdr.ar_op = htons(arp_type);
+	memcpy(arphdr->arp_sha, src_mac, ETH_ALEN);
+	*((unsigned int *)arphdr->arp_spa) = src_ip;
+	if (arp_type == ARPOP_REPLY)
+		memcpy(arphdr->arp_tha, dst_mac, ETH_ALEN);
+	else
+		memset(arphdr->arp_tha, 0, ETH_ALEN);
+	*((unsigned int *)arphdr->arp_tpa) = dst_ip;
 }
 
 int arp_req_send(const uint8_t *src_mac, const uint8_t *dst_mac,
 		 unsigned int src_ip, unsigned int dst_ip)
 {
-	arp_init(src_mac, dst_mac, src_ip, dst_ip, ARPOP_REQUEST);
+	out_packet_buff_get();
+	arp_init(out_packet_buff, src_mac, dst_mac, src_ip, dst_ip,
+		 ARPOP_REQUEST);
 
 	return socket_write(out_packet_buff, ARP_LEN);
 }
 
-static int arp_rep_send(const uint8_t *src_mac, const uint8_t *dst_mac,
-			unsigned int src_ip, unsigned int dst_ip)
+static unsigned short csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/* the frame headers sent to a detected node only change in a few fields */
+static void node_templates_init(struct node *node)
 {
-	arp_init(src_mac, dst_mac, src_ip, dst_ip, ARPOP_REPLY);
+	struct frame_templates *templates = &node->templates;
+	struct ether_header *ethhdr;
+	struct iphdr *iphdr;
 
-	/* fprintf(stderr, "arp_rep_send() to: %02x:%02x:%02x:%02x:%02x:%02x from %02x:%02x:%02x:%02x:%02x:%02x\n",
-			dst_mac[0], dst_mac[1], dst_mac[2],
-			dst_mac[3], dst_mac[4], dst_mac[5],
-			src_mac[0], src_mac[1], src_mac[2],
-			src_mac[3], src_mac[4], src_mac[5]);*/
+	arp_init(templates->arp_reply, node->our_mac_addr,
+		 node->his_mac_addr, node->our_ip_addr, node->his_ip_addr,
+		 ARPOP_REPLY);
 
-	return socket_write(out_packet_buff, ARP_LEN);
+	memset(templates->udp, 0, sizeof(templates->udp));
+	ethhdr = (struct ether_header *)templates->udp;
+	iphdr = (struct iphdr *)(templates->udp + ETH_HLEN);
+
+	memcpy(ethhdr->ether_shost, node->our_mac_addr, ETH_ALEN);
+	memcpy(ethhdr->ether_dhost, node->his_mac_addr, ETH_ALEN);
+	ethhdr->ether_type = htons(ETH_P_IP);
+
+	iphdr->version = 4;
+	iphdr->ihl = 5;
+	iphdr->ttl = 50;
+	iphdr->protocol = IPPROTO_UDP;
+	iphdr->saddr = node->our_ip_addr;
+	iphdr->daddr = node->his_ip_addr;
+
+	/* tot_len and check are 0 */
+	templates->ip_sum = chksum(0, (void *)iphdr, sizeof(struct iphdr));
+	templates->udp_sum = chksum(IPPROTO_UDP, (void *)&iphdr->saddr,
+				    2 * sizeof(iphdr->saddr));
 }
 
-static void tftp_packet_init(struct node *node, unsigned short src_port,
-			     unsigned short dst_port)
+/* the UDP checksum is filled in by the kernel / NIC with checksum offload */
+static int tftp_frame_write(const char *buff, int len)
 {
-	memcpy(out_ethhdr->ether_shost, node->our_mac_addr, ETH_ALEN);
-	memcpy(out_ethhdr->ether_dhost, node->his_mac_addr, ETH_ALEN);
-	out_ethhdr->ether_type = htons(ETH_P_IP);
+	return socket_write_csum(buff, len, ETH_HLEN + sizeof(struct iphdr),
+				 offsetof(struct udphdr, check));
+}
 
-	out_iphdr->version = 4;
-	out_iphdr->ihl = 5;
-	out_iphdr->tos = 0;
-	out_iphdr->id = 0;
-	out_iphdr->frag_off = 0;
-	out_iphdr->ttl = 50;
-	out_iphdr->protocol = IPPROTO_UDP;
-	out_iphdr->saddr = node->our_ip_addr;
-	out_iphdr->daddr = node->his_ip_addr;
+/*
+ * returns the length of the frame built in out_packet_buff - the last
+ * csum_len bytes of the TFTP data are summed up in csum already
+ */
+static int tftp_packet_build(struct node *node, unsigned short src_port,
+			     unsigned short dst_port, int tftp_data_len,
+			     int csum_len, unsigned short csum)
+{
+	unsigned short udp_len = sizeof(struct udphdr) + tftp_data_len;
+	unsigned short ip_len = sizeof(struct iphdr) + udp_len;
+	unsigned short sum;
+
+	memcpy(out_packet_buff, node->templates.udp,
+	       sizeof(node->templates.udp));
 
 	out_udphdr->source = src_port;
 	out_udphdr->dest = dst_port;
+	out_udphdr->len = htons(udp_len);
+
+	/* UDP checksum - the pseudo header length and the header length */
+	sum = csum_fold(node->templates.udp_sum + 2 * udp_len +
+			ntohs(src_port) + ntohs(dst_port));
+	if (socket_csum_offload()) {
+		/* the pseudo header sum - see socket_write_csum() */
+		out_udphdr->check = htons(csum_fold(node->templates.udp_sum +
+						    udp_len));
+	} else {
+		sum = chksum(sum, (void *)out_tftp_data,
+			     tftp_data_len - csum_len);
+		sum = csum_fold(sum + csum);
+		out_udphdr->check = ~(htons(sum));
+	}
+
+	out_iphdr->tot_len = htons(ip_len);
+	out_iphdr->check = ~(htons(csum_fold(node->templates.ip_sum + ip_len)));
+
+	return ETH_HLEN + ip_len;
 }
 
 static int tftp_packet_send_data(struct node *node, unsigned short src_port,
 				 unsigned short dst_port, int tftp_data_len)
 {
-	unsigned short sum;
-
-	tftp_packet_init(node, src_port, dst_port);
-	out_udphdr->len = htons(8 + tftp_data_len);
-
-	/* UDP checksum */
-	out_udphdr->check = 0;
-	sum = ntohs(out_udphdr->len) + out_iphdr->protocol;
-	sum = chksum(sum, (void *)&out_iphdr->saddr, 2 * sizeof(out_iphdr->saddr));
-	sum = chksum(sum, (void *)out_udphdr, ntohs(out_udphdr->len));
-	out_udphdr->check = ~(htons(sum));
+	int len;
 
-	out_iphdr->tot_len = htons(20 + 8 + tftp_data_len);
-	out_iphdr->check = 0;
-	out_iphdr->check = ~(htons(chksum(0, (void *)out_iphdr, sizeof(struct iphdr))));
+	len = tftp_packet_build(node, src_port, dst_port, tftp_data_len, 0, 0);
+	return tftp_frame_write(out_packet_buff, len);
+}
 
-	return socket_write(out_packet_buff,
-			    ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr) + tftp_data_len);
+/* the largest TFTP block which still fits into a single frame */
+static unsigned int tftp_blksize_max(void)
+{
+	return socket_mtu() - sizeof(struct iphdr) - sizeof(struct udphdr) - 4;
 }
 
 int tftp_init_upload(struct node *node)
 {
+	unsigned int tsize;
 	int data_len;
 
+	out_packet_buff_get();
+
 	/* TFTP write request */
 	*((unsigned short *)out_tftp_data) = htons(2);
 	data_len = 2;
@@ -183,6 +305,21 @@ int tftp_init_upload(struct node *node)
 	data_len += sprintf(out_tftp_data + data_len + 1, "%s", "octet");
 	data_len += 2; /* sprintf does not count \0 */
 
+	/* servers not knowing the options (RFC 2347) answer with a plain ack */
+	tsize = ((node->router_type->image->file_size + FLASH_PAGE_SIZE - 1) /
+		 FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
+	data_len += sprintf(out_tftp_data + data_len, "blksize") + 1;
+	data_len += sprintf(out_tftp_data + data_len, "%u",
+			    tftp_blksize_max()) + 1;
+	data_len += sprintf(out_tftp_data + data_len, "windowsize") + 1;
+	data_len += sprintf(out_tftp_data + data_len, "%u",
+			    TFTP_WINDOWSIZE_WRQ) + 1;
+	data_len += sprintf(out_tftp_data + data_len, "tsize") + 1;
+	data_len += sprintf(out_tftp_data + data_len, "%u", tsize) + 1;
+
+	node->image_state.block_size = TFTP_PAYLOAD_SIZE;
+	node->image_state.window_size = 1;
+
 	return tftp_packet_send_data(node, htons(TFTP_SRC_PORT),
 				     htons(IPPORT_TFTP), data_len);
 }
@@ -227,23 +364,30 @@ static void handle_arp_packet(const char *packet_buff, int packet_buff_len,
 
 	switch (node->status) {
 	case NODE_STATUS_UNKNOWN:
-		node->status = NODE_STATUS_DETECTING;
+		node_status_set(node, NODE_STATUS_DETECTING);
 		/* fall through */
 	case NODE_STATUS_DETECTING:
 		ret = router_types_detect_main(node, packet_buff,
 					       packet_buff_len);
+		if (ret == 0 && node->status == NODE_STATUS_DETECTING) {
+			/* might free the node */
+			node_detect_failed(node);
+			return;
+		}
+
 		if (ret != 1)
 			break;
 
-		node->status = NODE_STATUS_DETECTED;
+		node_status_set(node, NODE_STATUS_DETECTED);
+		node_templates_init(node);
+		node_detected(node);
 		/* fall through */
 	case NODE_STATUS_DETECTED:
 	case NODE_STATUS_FLASHING:
 		if (ntohs(arphdr->ea_hdr.ar_op) != ARPOP_REQUEST)
 			break;
 
-		arp_rep_send(node->our_mac_addr, node->his_mac_addr,
-			     node->our_ip_addr, node->his_ip_addr);
+		socket_write(node->templates.arp_reply, ARP_LEN);
 		break;
 	case NODE_STATUS_RESET_SENT:
 	case NODE_STATUS_FINISHED:
@@ -252,7 +396,7 @@ static void handle_arp_packet(const char *packet_buff, int packet_buff_len,
 			node->his_mac_addr[2], node->his_mac_addr[3],
 			node->his_mac_addr[4], node->his_mac_addr[5],
 			node->router_type->desc);
-		node->status = NODE_STATUS_REBOOTED;
+		node_status_set(node, NODE_STATUS_REBOOTED);
 #if defined(CLEAR_SCREEN)
 		num_nodes_flashed++;
 #endif
@@ -263,14 +407,338 @@ static void handle_arp_packet(const char *packet_buff, int packet_buff_len,
 	}
 }
 
+/**
+ * tftp_options() - negotiate TFTP options (RFC 2347)
+ * @node: node the options were received from
+ * @opts: first option name
+ * @end: end of the received TFTP packet
+ * @oack: buffer of TFTP_OACK_MAX bytes the options of the OACK answer are
+ *  written to, NULL if the options are the OACK answer to our own request
+ *
+ * Every option is only accepted once and options which don't fit into the
+ * OACK anymore are ignored.
+ *
+ * Return: length of the options written to @oack, 0 if none of the
+ * supported options was found
+ */
+static int tftp_options(struct node *node, const char *opts, const char *end,
+			char *oack)
+{
+	const char *name, *value;
+	unsigned long val;
+	char *val_end;
+	int oack_len = 0, name_len, val_len;
+	unsigned int option, seen = 0;
+	char val_buff[24];
+
+	while (opts < end) {
+		name = opts;
+		value = memchr(name, '\0', end - name);
+		if (!value)
+			break;
+
+		value++;
+		opts = memchr(value, '\0', end - value);
+		if (!opts)
+			break;
+
+		opts++;
+
+		val = strtoul(value, &val_end, 10);
+		if ((val_end == value) || (*val_end != '\0'))
+			continue;
+
+		if (strcasecmp(name, "blksize") == 0)
+			option = TFTP_OPTION_BLKSIZE;
+		else if (strcasecmp(name, "windowsize") == 0)
+			option = TFTP_OPTION_WINDOWSIZE;
+		else if (strcasecmp(name, "tsize") == 0)
+			option = TFTP_OPTION_TSIZE;
+		else
+			/* unknown options are not acknowledged */
+			continue;
+
+		if (seen & option)
+			continue;
+
+		switch (option) {
+		case TFTP_OPTION_BLKSIZE:
+			if ((val < TFTP_BLKSIZE_MIN) || (val > TFTP_BLKSIZE_MAX))
+				continue;
+
+			if (val > tftp_blksize_max())
+				val = tftp_blksize_max();
+
+			break;
+		case TFTP_OPTION_WINDOWSIZE:
+			if ((val < 1) || (val > 65535))
+				continue;
+
+			if (val > TFTP_WINDOWSIZE_MAX)
+				val = TFTP_WINDOWSIZE_MAX;
+
+			break;
+		case TFTP_OPTION_TSIZE:
+			/* RFC 2349: read requests ask for the size with 0 */
+			val = node->image_state.flash_size;
+			break;
+		}
+
+		/* an option which can't be acknowledged must not be used */
+		if (oack) {
+			val_len = snprintf(val_buff, sizeof(val_buff), "%lu",
+					   val);
+			name_len = strlen(name);
+			if (name_len + val_len + 2 > (int)TFTP_OACK_MAX - oack_len)
+				break;
+
+			memcpy(oack + oack_len, name, name_len + 1);
+			oack_len += name_len + 1;
+			memcpy(oack + oack_len, val_buff, val_len + 1);
+			oack_len += val_len + 1;
+		}
+
+		if (option == TFTP_OPTION_BLKSIZE)
+			node->image_state.block_size = val;
+		else if (option == TFTP_OPTION_WINDOWSIZE)
+			node->image_state.window_size = val;
+
+		seen |= option;
+	}
+
+	return oack_len;
+}
+
+/* options of a read request, see tftp_options() */
+static int tftp_rrq_options(struct node *node, const char *req, int req_len,
+			    char *oack)
+{
+	const char *end = req + req_len;
+	int i;
+
+	/* skip opcode, file name and mode */
+	req += 2;
+	for (i = 0; i < 2; i++) {
+		req = memchr(req, '\0', end - req);
+		if (!req)
+			return 0;
+
+		req++;
+	}
+
+	return tftp_options(node, req, end, oack);
+}
+
+/* update the round trip estimation with a new sample (RFC 6298) */
+static void tftp_rtt_sample(struct image_state *image_state, unsigned int rtt)
+{
+	int err;
+
+	if (!image_state->rtt_valid) {
+		image_state->srtt = rtt << 3;
+		image_state->rttvar = rtt << 1;
+		image_state->rtt_valid = 1;
+	} else {
+		err = rtt - (image_state->srtt >> 3);
+		image_state->srtt += err;
+		if (err < 0)
+			err = -err;
+		image_state->rttvar += err - (image_state->rttvar >> 2);
+	}
+
+	image_state->rto = (image_state->srtt >> 3) +
+			   (image_state->rttvar ? image_state->rttvar : 1);
+	if (image_state->rto < TFTP_RTO_MIN)
+		image_state->rto = TFTP_RTO_MIN;
+	if (image_state->rto > TFTP_RTO_MAX)
+		image_state->rto = TFTP_RTO_MAX;
+}
+
+/* the device made progress - drop the timeout backoff */
+static void tftp_rto_reset(struct image_state *image_state)
+{
+	image_state->rto_backoff = image_state->rtt_valid ? image_state->rto :
+							    TFTP_RTO_INITIAL;
+	image_state->timeouts = 0;
+}
+
+/* (re)size the frame cache for the negotiated block and window size */
+static void tftp_frames_init(struct image_state *image_state)
+{
+	unsigned int slot_len, i;
+
+	slot_len = sizeof(struct tftp_frame) + TFTP_DATA_HLEN +
+		   image_state->block_size;
+	slot_len = (slot_len + 7) & ~7;
+
+	if (image_state->frames &&
+	    (image_state->frame_slots == image_state->window_size) &&
+	    (image_state->frame_slot_len == slot_len)) {
+		for (i = 0; i < image_state->frame_slots; i++)
+			((struct tftp_frame *)(image_state->frames + i * slot_len))->len = 0;
+		return;
+	}
+
+	tftp_frames_free(image_state);
+
+	/* without the cache the frames are rebuilt on retransmits */
+	image_state->frames = calloc(image_state->window_size, slot_len);
+	if (!image_state->frames)
+		return;
+
+	image_state->frame_slots = image_state->window_size;
+	image_state->frame_slot_len = slot_len;
+}
+
+void tftp_frames_free(struct image_state *image_state)
+{
+	free(image_state->frames);
+	image_state->frames = NULL;
+	image_state->frame_slots = 0;
+	image_state->frame_slot_len = 0;
+}
+
+static struct tftp_frame *tftp_frame_get(struct image_state *image_state,
+					 unsigned short block)
+{
+	if (!image_state->frames)
+		return NULL;
+
+	return (struct tftp_frame *)(image_state->frames +
+				     (block % image_state->frame_slots) *
+				     image_state->frame_slot_len);
+}
+
+/* resend everything after the last acked block */
+static void tftp_rollback(struct image_state *image_state)
+{
+	unsigned short outstanding;
+
+	outstanding = image_state->block_sent - image_state->block_acked;
+	if (outstanding == 0)
+		return;
+
+	tftp_blocks_resent += outstanding;
+	image_state->retransmitted = 1;
+	image_state->block_sent = image_state->block_acked;
+	image_state->bytes_sent = image_state->bytes_acked;
+}
+
+static int tftp_send_window(struct node *node)
+{
+	struct tftp_frame *frame;
+	unsigned short block, csum;
+	int ret, data_len, len;
+
+	/* keep up to window_size blocks (RFC 7440) in flight */
+	while ((unsigned short)(node->image_state.block_sent - node->image_state.block_acked) < node->image_state.window_size) {
+		block = node->image_state.block_sent + 1;
+		frame = tftp_frame_get(&node->image_state, block);
+
+		/* retransmit - the frame is still around */
+		if (frame && frame->len && frame->block == block) {
+			ret = tftp_frame_write(frame->buff, frame->len);
+			if (ret < 0)
+				return ret;
+
+			data_len = frame->len - TFTP_DATA_HLEN + 4;
+			goto sent;
+		}
+
+		/* TFTP DATA packet */
+		out_packet_buff_get();
+		*((unsigned short *)out_tftp_data) = htons(3);
+		*((unsigned short *)(out_tftp_data + 2)) = htons(block);
+
+		data_len = router_images_read_data(out_tftp_data + 4, node);
+		if (data_len < 0)
+			break;
+
+		csum = 0;
+		if (!socket_csum_offload())
+			csum = router_images_data_csum(node, out_tftp_data + 4,
+						       data_len);
+		len = tftp_packet_build(node, node->image_state.src_port,
+					node->image_state.dst_port,
+					data_len + 4, /* opcode size */
+					data_len, csum);
+		data_len += 4;
+		if (frame) {
+			memcpy(frame->buff, out_packet_buff, len);
+			frame->block = block;
+			frame->len = len;
+		}
+
+		ret = tftp_frame_write(out_packet_buff, len);
+		if (ret < 0)
+			return ret;
+
+sent:
+		node->image_state.last_packet_size = data_len - 4; /* opcode size */
+		node->image_state.bytes_sent += node->image_state.last_packet_size;
+		node->image_state.block_sent = block;
+
+		/* the last block of the file */
+		if (node->image_state.last_packet_size != node->image_state.block_size)
+			break;
+	}
+
+	if (node->image_state.block_sent == node->image_state.block_acked)
+		return 0;
+
+	node->image_state.window_sent = timer_now();
+	timer_add(&node->tftp_timer, node->image_state.rto_backoff);
+	return 0;
+}
+
+void tftp_timeout(void *data)
+{
+	struct node *node = data;
+
+	if (node->image_state.block_sent == node->image_state.block_acked)
+		return;
+
+	/* the device is gone or stuck - its own timeouts take over */
+	if (node->image_state.timeouts >= TFTP_TIMEOUTS_MAX)
+		return;
+
+	node->image_state.timeouts++;
+	node->image_state.rto_backoff *= 2;
+	if (node->image_state.rto_backoff > TFTP_RTO_MAX)
+		node->image_state.rto_backoff = TFTP_RTO_MAX;
+	tftp_timeouts++;
+
+	tftp_rollback(&node->image_state);
+	tftp_send_window(node);
+}
+
+/* the client repeated its request before it acked any of our data */
+static int tftp_rrq_is_dup(const struct node *node,
+			   const struct file_info *file_info,
+			   unsigned short port)
+{
+	const struct image_state *image_state = &node->image_state;
+
+	if ((image_state->bytes_sent == 0) || (image_state->bytes_acked != 0))
+		return 0;
+
+	if (image_state->dst_port != port)
+		return 0;
+
+	return (image_state->offset == file_info->file_offset) &&
+	       (image_state->file_size == file_info->file_size);
+}
+
 static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 			      struct node *node)
 {
 	struct udphdr *udphdr;
 	struct file_info *file_info;
-	unsigned short opcode, block;
+	unsigned short opcode, block, outstanding, acked;
 	const char *file_name;
-	int ret, data_len;
+	int ret, tftp_len, oack_len = 0;
+	char err_msg[256];
+	size_t err_len;
 	static const char fwupgradecfg[] = "fwupgrade.cfg";
 
 	if (!len_check(packet_buff_len, sizeof(struct udphdr), "UDP"))
@@ -278,6 +746,15 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 
 	udphdr = (struct udphdr *)packet_buff;
 
+	tftp_len = ntohs(udphdr->len);
+	if (tftp_len > packet_buff_len)
+		tftp_len = packet_buff_len;
+	tftp_len -= sizeof(struct udphdr);
+
+	/* opcode and block number / first bytes of the file name */
+	if (tftp_len < 4)
+		return;
+
 	switch (node->flash_mode) {
 	case FLASH_MODE_REDBOOT:
 	case FLASH_MODE_TFTP_CLIENT:
@@ -299,16 +776,34 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 	/* fprintf(stderr, "tftp opcode=%d, block=%d, len=%i\n", opcode,
 		block, htons(rcv_udphdr->len) - sizeof(struct udphdr)); */
 
+	/* the TFTP server accepted options of our write request */
+	if ((opcode == 6) && (node->flash_mode == FLASH_MODE_TFTP_SERVER)) {
+		/* duplicate - the negotiated sizes are in use already */
+		if (node->image_state.bytes_sent != 0)
+			return;
+
+		tftp_options(node, packet_buff + sizeof(struct udphdr) + 2,
+			     packet_buff + sizeof(struct udphdr) + tftp_len, NULL);
+
+		/* acks the write request just like a plain ack of block 0 */
+		opcode = 4;
+		block = 0;
+	}
+
 	switch (opcode) {
 	/* TFTP read request */
 	case 1:
+		/* frames aren't zero terminated - the name has to end in it */
 		file_name = packet_buff + sizeof(struct udphdr) + 2;
+		if (!memchr(file_name, '\0', tftp_len - 2))
+			goto out;
+
 		switch (node->flash_mode) {
 		case FLASH_MODE_UKNOWN:
 			/* ignore */
 			break;
 		case FLASH_MODE_TFTP_SERVER:
-			/* ignored; handled in node_list_maintain */
+			/* ignored; handled by the node retry timer */
 			break;
 		case FLASH_MODE_REDBOOT:
 		case FLASH_MODE_TFTP_CLIENT:
@@ -326,13 +821,43 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 				goto out;
 			}
 
+			/* only the blocks in flight are sent again */
+			if (tftp_rrq_is_dup(node, file_info, udphdr->source)) {
+				tftp_dup_rrqs++;
+				tftp_rollback(&node->image_state);
+				tftp_send_window(node);
+				goto out;
+			}
+
 			if (node->image_state.fd <= 0) {
 				ret = router_images_open_path(node);
 				if (ret < 0)
 					goto out;
-				node->status = NODE_STATUS_FLASHING;
+				node_status_set(node, NODE_STATUS_FLASHING);
 			}
 
+			/* nothing of a previous transfer may be resent */
+			timer_del(&node->tftp_timer);
+			tftp_frames_free(&node->image_state);
+			node->image_state.block_acked = 0;
+			node->image_state.block_sent = 0;
+			node->image_state.bytes_acked = 0;
+			node->image_state.retransmitted = 0;
+			tftp_rto_reset(&node->image_state);
+
+			router_images_prefetch(node, file_info);
+
+			node->image_state.file_size = file_info->file_size;
+			node->image_state.flash_size = file_info->file_fsize;
+			node->image_state.offset = file_info->file_offset;
+			node->image_state.block_size = TFTP_PAYLOAD_SIZE;
+			node->image_state.window_size = 1;
+
+			out_packet_buff_get();
+			oack_len = tftp_rrq_options(node,
+						    packet_buff + sizeof(struct udphdr),
+						    tftp_len, out_tftp_data + 2);
+
 			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: tftp client asks for '%s', serving %s portion of: %s (%i blocks) ...\n",
 				node->his_mac_addr[0], node->his_mac_addr[1],
 				node->his_mac_addr[2], node->his_mac_addr[3],
@@ -340,31 +865,38 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 				node->router_type->desc,
 				file_name,file_info->file_name,
 				node->router_type->image->path ? node->router_type->image->path : "embedded image",
-				((file_info->file_fsize + TFTP_PAYLOAD_SIZE - 1) / TFTP_PAYLOAD_SIZE));
-
-			node->image_state.file_size = file_info->file_size;
-			node->image_state.flash_size = file_info->file_fsize;
-			node->image_state.offset = file_info->file_offset;
+				((file_info->file_fsize + node->image_state.block_size - 1) / node->image_state.block_size));
 			break;
 		}
 
 		block = 0;
 		node->image_state.bytes_sent = 0;
 		node->image_state.last_packet_size = 0;
+		node->image_state.src_port = udphdr->dest;
+		node->image_state.dst_port = udphdr->source;
 
 		if (strncmp(file_name, fwupgradecfg, strlen(fwupgradecfg)) == 0)
 			node->image_state.count_globally = 0;
 		else
 			node->image_state.count_globally = 1;
+
+		/* the first block is sent once the client acked the options */
+		if (oack_len > 0) {
+			*((unsigned short *)out_tftp_data) = htons(6);
+			tftp_packet_send_data(node, udphdr->dest, udphdr->source,
+					      oack_len + 2);
+			goto out;
+		}
 		/* fall through - start sending data */
 	/* TFTP ack */
 	case 4:
-		if (block == 0) {
+		/* block 0 acks the write request / options, not a wrapped block */
+		if (block == 0 && node->image_state.bytes_sent == 0) {
 			if (node->flash_mode == FLASH_MODE_TFTP_SERVER) {
 				ret = router_images_open_path(node);
 				if (ret < 0)
 					return;
-				node->status = NODE_STATUS_FLASHING;
+				node_status_set(node, NODE_STATUS_FLASHING);
 				node->image_state.file_size = node->router_type->image->file_size;
 				node->image_state.flash_size = ((node->router_type->image->file_size + FLASH_PAGE_SIZE - 1) /
 										FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
@@ -378,38 +910,81 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 					node->his_mac_addr[4],
 					node->his_mac_addr[5],
 					node->router_type->desc,
-					((node->image_state.flash_size + TFTP_PAYLOAD_SIZE - 1) / TFTP_PAYLOAD_SIZE));
+					((node->image_state.flash_size + node->image_state.block_size - 1) / node->image_state.block_size));
 			}
 
 			node->image_state.block_acked = 0;
 			node->image_state.block_sent = 0;
-		} else if (block != node->image_state.block_sent) {
-			if (block < node->image_state.block_sent)
-				fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: tftp repeat block %d, last received ack: %d\n",
-					node->his_mac_addr[0],
-					node->his_mac_addr[1],
-					node->his_mac_addr[2],
-					node->his_mac_addr[3],
-					node->his_mac_addr[4],
-					node->his_mac_addr[5],
-					node->router_type->desc, block + 1,
-					node->image_state.block_acked);
-			else
-				fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: tftp acks unsent block %d (last sent block: %d)\n",
-					node->his_mac_addr[0],
-					node->his_mac_addr[1],
-					node->his_mac_addr[2],
-					node->his_mac_addr[3],
-					node->his_mac_addr[4],
-					node->his_mac_addr[5],
-					node->router_type->desc, block,
-					node->image_state.block_sent);
+			node->image_state.bytes_acked = 0;
+			node->image_state.src_port = udphdr->dest;
+			node->image_state.dst_port = udphdr->source;
+			node->image_state.retransmitted = 0;
+			tftp_rto_reset(&node->image_state);
+			tftp_frames_init(&node->image_state);
+			goto send_window;
+		}
+
+		/* blocks in flight and blocks this ack covers (block numbers wrap) */
+		outstanding = node->image_state.block_sent - node->image_state.block_acked;
+		acked = block - node->image_state.block_acked;
+
+		/*
+		 * Answering duplicate acks would send every following block
+		 * twice (Sorcerer's Apprentice, RFC 1123 4.2.3.1) - stale acks
+		 * are dropped and lost blocks are resent by our timer
+		 */
+		if (((short)acked < 0) ||
+		    ((acked == 0) && (outstanding > 0) &&
+		     timer_pending(&node->tftp_timer))) {
+			tftp_dup_acks++;
+			goto out;
+		}
+
+		if (acked > outstanding) {
+			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: tftp acks unsent block %d (last sent block: %d)\n",
+				node->his_mac_addr[0],
+				node->his_mac_addr[1],
+				node->his_mac_addr[2],
+				node->his_mac_addr[3],
+				node->his_mac_addr[4],
+				node->his_mac_addr[5],
+				node->router_type->desc, block,
+				node->image_state.block_sent);
+			acked = 0;
+		} else if (acked < outstanding) {
+			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: tftp repeat block %d, last received ack: %d\n",
+				node->his_mac_addr[0],
+				node->his_mac_addr[1],
+				node->his_mac_addr[2],
+				node->his_mac_addr[3],
+				node->his_mac_addr[4],
+				node->his_mac_addr[5],
+				node->router_type->desc, block + 1,
+				node->image_state.block_acked);
+		}
+
+		if (acked > 0)
+			tftp_rto_reset(&node->image_state);
+
+		if (acked == outstanding) {
+			/* no samples of retransmitted blocks (Karn's algorithm) */
+			if (acked > 0 && !node->image_state.retransmitted)
+				tftp_rtt_sample(&node->image_state,
+						timer_now() - node->image_state.window_sent);
+			node->image_state.retransmitted = 0;
+
+			node->image_state.block_acked = node->image_state.block_sent;
+			node->image_state.bytes_acked = node->image_state.bytes_sent;
 
-			block = node->image_state.block_acked;
-			node->image_state.bytes_sent -= node->image_state.last_packet_size;
-		} else {
 			/* nothing more to send */
-			if (node->image_state.last_packet_size != TFTP_PAYLOAD_SIZE) {
+			if (node->image_state.last_packet_size != node->image_state.block_size) {
+				/* duplicate ack of the last block */
+				if (acked == 0)
+					goto out;
+
+				timer_del(&node->tftp_timer);
+				tftp_frames_free(&node->image_state);
+
 				/* don't count this file as payload? */
 				if (!node->image_state.count_globally)
 					goto out;
@@ -430,8 +1005,8 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 							node->router_type->desc);
 						router_images_close_path(node);
 						if (node->flash_mode == FLASH_MODE_TFTP_CLIENT)
-							tftp_client_flash_time_set(node);
-						node->status = NODE_STATUS_FINISHED;
+							node_flash_wait(node, tftp_client_flash_time(node));
+						node_status_set(node, NODE_STATUS_FINISHED);
 						break;
 					case FLASH_MODE_REDBOOT:
 						/* ignored; handled in REDBOOT_STATE_EXECY */
@@ -444,48 +1019,42 @@ static void handle_udp_packet(const char *packet_buff, int packet_buff_len,
 
 				goto out;
 			}
+		} else {
+			/* all blocks but the last one are full sized */
+			node->image_state.block_acked += acked;
+			node->image_state.bytes_acked += acked * node->image_state.block_size;
 
-			node->image_state.block_acked = block;
+			/* go back to the first block the client did not get */
+			tftp_rollback(&node->image_state);
 		}
 
-		block++;
-
-		/* TFTP DATA packet */
-		*((unsigned short *)out_tftp_data) = htons(3);
-		*((unsigned short *)(out_tftp_data + 2)) = htons(block);
-
-		data_len = router_images_read_data(out_tftp_data + 4, node);
-		if (data_len < 0)
-			break;
-
-		data_len += 4; /* opcode size */
-
-		ret = tftp_packet_send_data(node, udphdr->dest, udphdr->source,
-					    data_len);
-		if (ret < 0)
-			return;
-
-		node->image_state.last_packet_size = data_len - 4; /* opcode size */
-		node->image_state.bytes_sent += node->image_state.last_packet_size;
-		node->image_state.block_sent = block;
-		/* printf("tftp data out: tftp_sent=%lu, remaining_size=%lu, data_len=%i, block=%d\n",
-			tftp_sent, tftp_xfer_size - tftp_sent, tftp_data_len - 4, block); */
+send_window:
+		tftp_send_window(node);
 		break;
 	/* TFTP error */
 	case 5:
-		if ((block == 2) && (htons(udphdr->len) - sizeof(struct udphdr) > 4))
+		if ((block == 2) && (tftp_len > 4)) {
+			err_len = strnlen(packet_buff + sizeof(struct udphdr) + 4,
+					  tftp_len - 4);
+			if (err_len > sizeof(err_msg) - 1)
+				err_len = sizeof(err_msg) - 1;
+
+			memcpy(err_msg, packet_buff + sizeof(struct udphdr) + 4,
+			       err_len);
+			err_msg[err_len] = '\0';
+
 			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: received TFTP error: %s\n",
 				node->his_mac_addr[0], node->his_mac_addr[1],
 				node->his_mac_addr[2], node->his_mac_addr[3],
 				node->his_mac_addr[4], node->his_mac_addr[5],
-				node->router_type->desc,
-				(packet_buff + sizeof(struct udphdr) + 4));
-		else
+				node->router_type->desc, err_msg);
+		} else {
 			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: %s router: received TFTP error code: %d\n",
 				node->his_mac_addr[0], node->his_mac_addr[1],
 				node->his_mac_addr[2], node->his_mac_addr[3],
 				node->his_mac_addr[4], node->his_mac_addr[5],
 				node->router_type->desc, block);
+		}
 
 		break;
 	default:
@@ -585,15 +1154,22 @@ static int tcp_send(struct node *node, int tcp_data_len,
 	else
 		sum = (tcphdr->doff * 4) + tcp_data_len + iphdr->protocol;
 	sum = chksum(sum, (void *)&iphdr->saddr, 2 * sizeof(iphdr->saddr));
-	sum = chksum(sum, (void *)tcphdr, sizeof(struct tcphdr) + tcp_data_len);
-	tcphdr->check = ~(htons(sum));
+	if (socket_csum_offload()) {
+		tcphdr->check = htons(sum);
+	} else {
+		sum = chksum(sum, (void *)tcphdr,
+			     sizeof(struct tcphdr) + tcp_data_len);
+		tcphdr->check = ~(htons(sum));
+	}
 
 	iphdr->tot_len = htons(sizeof(struct iphdr) + sizeof(struct tcphdr) + tcp_data_len);
 	iphdr->check = 0;
 	iphdr->check = ~(htons(chksum(0, (void *)iphdr, sizeof(struct iphdr))));
 
-	return socket_write(node->tcp_state.packet_buff,
-			    ETH_HLEN + sizeof(struct iphdr) + sizeof(struct tcphdr) + tcp_data_len);
+	return socket_write_csum(node->tcp_state.packet_buff,
+				 ETH_HLEN + sizeof(struct iphdr) + sizeof(struct tcphdr) + tcp_data_len,
+				 ETH_HLEN + sizeof(struct iphdr),
+				 offsetof(struct tcphdr, check));
 }
 
 static int tcp_send_syn(struct node *node)
@@ -663,12 +1239,16 @@ static void handle_tcp_packet(char *packet_buff, int packet_buff_len,
 	struct tcphdr *tcphdr;
 	unsigned int data_len;
 	char *buff;
+	char telnet_msg[PACKET_BUFF_LEN];
 
 	if (!len_check(packet_buff_len, sizeof(struct tcphdr), "TCP"))
 		goto out;
 
 	tcphdr = (struct tcphdr *)packet_buff;
 
+	if (!len_check(packet_buff_len, tcphdr->doff * 4, "TCP full"))
+		goto out;
+
 	/* not telnet */
 	if (tcphdr->source != htons(REDBOOT_TELNET_DPORT))
 		goto out;
@@ -695,8 +1275,6 @@ static void handle_tcp_packet(char *packet_buff, int packet_buff_len,
 		if (tcphdr->syn != 0)
 			goto out;
 
-		packet_buff[packet_buff_len - 1] = '\0';
-		buff = (char *)(tcphdr + 1);
 		node->tcp_state.status = TCP_STATUS_TELNET_READY;
 		node->tcp_state.my_ack_seq += data_len;
 
@@ -732,8 +1310,14 @@ static void handle_tcp_packet(char *packet_buff, int packet_buff_len,
 		node->tcp_state.my_ack_seq += data_len;
 		if (ntohl(tcphdr->ack_seq) > node->tcp_state.my_seq)
 			node->tcp_state.my_seq = ntohl(tcphdr->ack_seq);
-		packet_buff[packet_buff_len] = '\0';
-		redboot_main(node, (char *)(tcphdr + 1));
+
+		/* the received frame may not be terminated or writable */
+		if (data_len > sizeof(telnet_msg) - 1)
+			data_len = sizeof(telnet_msg) - 1;
+
+		memcpy(telnet_msg, packet_buff + (tcphdr->doff * 4), data_len);
+		telnet_msg[data_len] = '\0';
+		redboot_main(node, telnet_msg);
 		break;
 	default:
 		return;
@@ -817,11 +1401,15 @@ void handle_eth_packet(char *packet_buff, int packet_buff_len)
 	if (memcmp(eth_hdr->ether_shost, bcast_addr, ETH_ALEN) == 0)
 		return;
 
+	if (negcache_find(eth_hdr->ether_shost))
+		return;
+
 	switch (ntohs(eth_hdr->ether_type)) {
 	case ETH_P_ARP:
-		node = node_list_get(eth_hdr->ether_shost);
+		node = node_table_get(eth_hdr->ether_shost);
 		if (!node)
 			return;
+		node_touch(node);
 		handle_arp_packet(packet_buff + ETH_HLEN,
 				  packet_buff_len - ETH_HLEN,
 				  node);
@@ -830,10 +1418,12 @@ void handle_eth_packet(char *packet_buff, int packet_buff_len)
 		if (memcmp(eth_hdr->ether_dhost, bcast_addr, ETH_ALEN) == 0)
 			return;
 
-		node = node_list_get(eth_hdr->ether_shost);
+		/* only nodes detected via ARP are of any interest */
+		node = node_table_find(eth_hdr->ether_shost);
 		if (!node)
 			return;
 
+		node_touch(node);
 		handle_ip_packet(packet_buff + ETH_HLEN,
 				 packet_buff_len - ETH_HLEN,
 				 node);
@@ -844,26 +1434,216 @@ void handle_eth_packet(char *packet_buff, int packet_buff_len)
 	}
 }
 
+#if defined(LINUX)
+/* jump targets are resolved once the whole program has been emitted */
+enum filter_label {
+	FILTER_LABEL_ACCEPT,
+	FILTER_LABEL_DROP,
+	FILTER_LABEL_IP,
+	FILTER_LABEL_UDP,
+	FILTER_LABEL_TCP,
+	FILTER_LABEL_SRC_MAC,
+	FILTER_LABEL_NUM,
+};
+
+#define FILTER_LABEL_BASE 0xf0
+#define FILTER_LABEL(label) (FILTER_LABEL_BASE + (label))
+#define FILTER_LEN_MAX (FILTER_LABEL_BASE - 1)
+#define FILTER_SNAPLEN 0x40000
+#define FILTER_WORD(b) (((uint32_t)(b)[0] << 24) | ((b)[1] << 16) | \
+			((b)[2] << 8) | (b)[3])
+
+struct filter_prog {
+	struct sock_filter insns[FILTER_LEN_MAX];
+	unsigned short len;
+	unsigned short labels[FILTER_LABEL_NUM];
+};
+
+static void filter_stmt(struct filter_prog *prog, uint16_t code, uint32_t k)
+{
+	struct sock_filter insn = BPF_STMT(code, k);
+
+	prog->insns[prog->len++] = insn;
+}
+
+static void filter_jump(struct filter_prog *prog, uint16_t code, uint32_t k,
+			uint8_t jt, uint8_t jf)
+{
+	struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+
+	prog->insns[prog->len++] = insn;
+}
+
+static void filter_label(struct filter_prog *prog, enum filter_label label)
+{
+	prog->labels[label] = prog->len;
+}
+
+static uint8_t filter_resolve(const struct filter_prog *prog, uint8_t jump,
+			      unsigned short pos)
+{
+	if (jump < FILTER_LABEL_BASE)
+		return jump;
+
+	return prog->labels[jump - FILTER_LABEL_BASE] - pos - 1;
+}
+
+/* accept frames whose destination is one of our 00:ba:be:ca:ff:xx addresses */
+static void filter_our_mac(struct filter_prog *prog, const uint8_t *our_mac,
+			   uint8_t match)
+{
+	filter_stmt(prog, BPF_LD | BPF_W | BPF_ABS, 0);
+	filter_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_WORD(our_mac),
+		    0, FILTER_LABEL(FILTER_LABEL_DROP));
+	filter_stmt(prog, BPF_LD | BPF_H | BPF_ABS, 4);
+	filter_stmt(prog, BPF_ALU | BPF_AND | BPF_K, 0xff00);
+	filter_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, our_mac[4] << 8,
+		    match, FILTER_LABEL(FILTER_LABEL_DROP));
+}
+
+/**
+ * proto_filter_update() - let the kernel drop frames we would ignore anyway
+ * @our_mac: the first 5 bytes select the range of our own mac addresses
+ * @his_macs: mac addresses of all nodes which may send IP traffic
+ * @num_macs: number of mac addresses in @his_macs
+ *
+ * Only ARP frames to broadcast or to us, TFTP and redboot telnet frames
+ * are passed up. IP frames additionally have to come from one of the given
+ * nodes, unless there are more than PROTO_FILTER_MACS_MAX of them.
+ */
+void proto_filter_update(const uint8_t *our_mac, const uint8_t *his_macs,
+			 unsigned int num_macs)
+{
+	static struct filter_prog prog;
+	struct sock_fprog fprog;
+	const uint8_t *mac;
+	unsigned short i;
+
+	memset(&prog, 0, sizeof(prog));
+
+#if defined(SKF_AD_PKTTYPE)
+	/* don't parse our own frames */
+	filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING,
+		    FILTER_LABEL(FILTER_LABEL_DROP), 0);
+#endif
+
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, 12);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP,
+		    0, FILTER_LABEL(FILTER_LABEL_IP));
+
+	/* ARP: broadcast or one of our addresses */
+	filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, 0);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, 0, 2);
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, 4);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, 0xffff,
+		    FILTER_LABEL(FILTER_LABEL_ACCEPT), 0);
+	filter_our_mac(&prog, our_mac, FILTER_LABEL(FILTER_LABEL_ACCEPT));
+
+	/* IPv4: unicast to us, first fragment */
+	filter_label(&prog, FILTER_LABEL_IP);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP,
+		    0, FILTER_LABEL(FILTER_LABEL_DROP));
+	filter_our_mac(&prog, our_mac, 0);
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 6);
+	filter_jump(&prog, BPF_JMP | BPF_JSET | BPF_K, 0x1fff,
+		    FILTER_LABEL(FILTER_LABEL_DROP), 0);
+	filter_stmt(&prog, BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN);
+	filter_stmt(&prog, BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 9);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP,
+		    FILTER_LABEL(FILTER_LABEL_UDP), 0);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP,
+		    FILTER_LABEL(FILTER_LABEL_TCP),
+		    FILTER_LABEL(FILTER_LABEL_DROP));
+
+	/* UDP: TFTP in either direction */
+	filter_label(&prog, FILTER_LABEL_UDP);
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_IND, ETH_HLEN);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, IPPORT_TFTP,
+		    FILTER_LABEL(FILTER_LABEL_SRC_MAC), 0);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, TFTP_SRC_PORT,
+		    FILTER_LABEL(FILTER_LABEL_SRC_MAC), 0);
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, IPPORT_TFTP,
+		    FILTER_LABEL(FILTER_LABEL_SRC_MAC), 0);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, TFTP_SRC_PORT,
+		    FILTER_LABEL(FILTER_LABEL_SRC_MAC),
+		    FILTER_LABEL(FILTER_LABEL_DROP));
+
+	/* TCP: redboot telnet replies */
+	filter_label(&prog, FILTER_LABEL_TCP);
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_IND, ETH_HLEN);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, REDBOOT_TELNET_DPORT,
+		    0, FILTER_LABEL(FILTER_LABEL_DROP));
+	filter_stmt(&prog, BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2);
+	filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, REDBOOT_TELNET_SPORT,
+		    FILTER_LABEL(FILTER_LABEL_SRC_MAC),
+		    FILTER_LABEL(FILTER_LABEL_DROP));
+
+	/* IPv4 is only handled for detected nodes */
+	filter_label(&prog, FILTER_LABEL_SRC_MAC);
+	if (num_macs > PROTO_FILTER_MACS_MAX) {
+		filter_stmt(&prog, BPF_RET | BPF_K, FILTER_SNAPLEN);
+		num_macs = 0;
+	}
+
+	for (i = 0; i < num_macs; i++) {
+		mac = his_macs + i * ETH_ALEN;
+
+		filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, ETH_ALEN);
+		filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_WORD(mac),
+			    0, 2);
+		filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, ETH_ALEN + 4);
+		filter_jump(&prog, BPF_JMP | BPF_JEQ | BPF_K,
+			    (mac[4] << 8) | mac[5],
+			    FILTER_LABEL(FILTER_LABEL_ACCEPT), 0);
+	}
+
+	filter_label(&prog, FILTER_LABEL_DROP);
+	filter_stmt(&prog, BPF_RET | BPF_K, 0);
+
+	filter_label(&prog, FILTER_LABEL_ACCEPT);
+	filter_stmt(&prog, BPF_RET | BPF_K, FILTER_SNAPLEN);
+
+	for (i = 0; i < prog.len; i++) {
+		if (BPF_CLASS(prog.insns[i].code) != BPF_JMP)
+			continue;
+
+		prog.insns[i].jt = filter_resolve(&prog, prog.insns[i].jt, i);
+		prog.insns[i].jf = filter_resolve(&prog, prog.insns[i].jf, i);
+	}
+
+	fprog.len = prog.len;
+	fprog.filter = prog.insns;
+	socket_filter_attach(&fprog);
+}
+#else
+void proto_filter_update(const uint8_t *our_mac __attribute__((unused)),
+			 const uint8_t *his_macs __attribute__((unused)),
+			 unsigned int num_macs __attribute__((unused)))
+{
+}
+#endif
+
 int proto_init(void)
 {
-	int ret = -1;
+	out_packet_buff_get();
 
-	out_packet_buff = malloc(PACKET_BUFF_LEN);
-	if (!out_packet_buff)
-		goto out;
+	return 0;
+}
 
-	out_ethhdr = (struct ether_header *)out_packet_buff;
-	out_arphdr = (struct ether_arp *)(out_packet_buff + ETH_HLEN);
-	out_iphdr = (struct iphdr *)(out_packet_buff + ETH_HLEN);
-	out_udphdr = (struct udphdr *)(out_packet_buff + ETH_HLEN + sizeof(struct iphdr));
-	out_tftp_data = (void *)(out_packet_buff + ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr));
-	ret = 0;
+void proto_print_stats(void)
+{
+	if (!tftp_timeouts && !tftp_blocks_resent && !tftp_dup_acks &&
+	    !tftp_dup_rrqs)
+		return;
 
-out:
-	return ret;
+	fprintf(stderr, "TFTP: %lu retransmission timeouts, %lu blocks resent, %lu duplicate acks ignored, %lu duplicate read requests\n",
+		tftp_timeouts, tftp_blocks_resent, tftp_dup_acks,
+		tftp_dup_rrqs);
 }
 
 void proto_free(void)
 {
-	free(out_packet_buff);
+	out_packet_buff = NULL;
 }
@@ -24,9 +24,13 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 struct node;
 
+/* beyond this many flashing nodes IP frames are not filtered by source */
+#define PROTO_FILTER_MACS_MAX 32
+
 enum tcp_status {
 	TCP_STATUS_SYN_SENT,
 	TCP_STATUS_ESTABLISHED,
@@ -43,9 +47,30 @@ struct tcp_state {
 	unsigned int my_ack_seq;
 };
 
+/* ethernet + IPv4 + UDP header - ethernet + ARP header */
+#define FRAME_TEMPLATE_LEN 42
+
+/* frame headers of a detected node - see node_templates_init() */
+struct frame_templates {
+	/* ports, lengths and checksums are filled in per frame */
+	char udp[FRAME_TEMPLATE_LEN];
+	char arp_reply[FRAME_TEMPLATE_LEN];
+	/* sums of the IP header and the UDP pseudo header without lengths */
+	uint32_t ip_sum;
+	uint32_t udp_sum;
+};
+
+/* fully built TFTP DATA frame kept for retransmits */
+struct tftp_frame {
+	unsigned short block;
+	unsigned short len;
+	char buff[];
+};
+
 struct image_state {
 	int fd;
 	unsigned int bytes_sent;
+	unsigned int bytes_acked;
 	unsigned int file_size;
 	unsigned int total_bytes_sent;
 	unsigned int flash_size;
@@ -53,17 +78,44 @@ struct image_state {
 	unsigned short last_packet_size;
 	unsigned short block_acked;
 	unsigned short block_sent;
+	/* negotiated TFTP block size (RFC 2348) and window size (RFC 7440) */
+	unsigned short block_size;
+	unsigned short window_size;
+	/* TFTP ports of the transfer (network byte order) */
+	unsigned short src_port;
+	unsigned short dst_port;
+	/* round trip estimation (RFC 6298) in ms - srtt scaled by 8, rttvar by 4 */
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int rto;
+	/* timeout including the backoff of consecutive timeouts */
+	unsigned int rto_backoff;
+	unsigned int timeouts;
+	/* time the last window was sent */
+	uint64_t window_sent;
+	/* frames of the blocks in flight - slot block % frame_slots */
+	char *frames;
+	unsigned int frame_slots;
+	unsigned int frame_slot_len;
 	/* flags */
 	unsigned char count_globally:1;
+	unsigned char rtt_valid:1;
+	/* blocks in flight were sent more than once (Karn's algorithm) */
+	unsigned char retransmitted:1;
 };
 
 int arp_req_send(const uint8_t *src_mac, const uint8_t *dst_mac,
 		 unsigned int src_ip, unsigned int dst_ip);
 int tftp_init_upload(struct node *node);
+void tftp_timeout(void *data);
+void tftp_frames_free(struct image_state *image_state);
 void telnet_handle_connection(struct node *node);
 int telnet_send_cmd(struct node *node, const char *cmd);
 void handle_eth_packet(char *packet_buff, int packet_buff_len);
+void proto_filter_update(const uint8_t *our_mac, const uint8_t *his_macs,
+			 unsigned int num_macs);
 int proto_init(void);
+void proto_print_stats(void);
 void proto_free(void);
 
 #if defined(DEBUG)
@@ -83,4 +135,16 @@ static inline int len_check(int buff_len, int req_len,
 	return 0;
 }
 
+/* hash of a mac address - every byte influences the upper 32 bits */
+static inline uint32_t mac_addr_hash(const uint8_t *mac_addr)
+{
+	uint64_t key = 0;
+
+	memcpy(&key, mac_addr, 6);
+	key ^= key >> 24;
+	key *= 0x9e3779b97f4a7c15ULL;
+
+	return key >> 32;
+}
+
 #endif /* __AP51_FLASH_PROTO_H__ */
@@ -0,0 +1,456 @@
+/*
+ * Copyright (C) Marek Lindner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ * License-Filename: LICENSES/preferred/GPL-3.0
+ */
+
+#include "readahead.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(LINUX) || defined(OSX)
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#define READAHEAD_SIZE_MAX 4096
+#define READAHEAD_CHUNK_LEN (256 * 1024)
+/* chunks requested beyond the one a block was read from */
+#define READAHEAD_AHEAD 2
+
+/*
+ * Image files which are neither mapped nor preloaded are read through a
+ * pool of fixed size chunks. A background thread fills the chunks following
+ * the one a node currently reads from, so the packet path usually only has
+ * to copy from memory. Chunks are identified by the fd of the image and
+ * their position in the file - nodes at similar offsets of the same image
+ * share them. When the pool is exhausted the least recently used chunk is
+ * reused. Blocks whose chunk isn't there (yet) are read directly.
+ */
+
+#if defined(LINUX) || defined(OSX)
+enum readahead_state {
+	READAHEAD_UNUSED,
+	READAHEAD_QUEUED,
+	READAHEAD_READING,
+	READAHEAD_READY,
+};
+
+struct readahead_chunk {
+	int fd;
+	size_t index;
+	enum readahead_state state;
+	/* bytes read - less than READAHEAD_CHUNK_LEN at the end of the file */
+	size_t len;
+	unsigned long last_use;
+	char *data;
+};
+
+static struct readahead_chunk *chunks;
+static unsigned int chunk_count;
+/* chunks waiting for the background thread */
+static struct readahead_chunk **queue;
+static unsigned int queue_head, queue_len;
+static unsigned long use_clock;
+
+static pthread_t readahead_thread;
+static bool readahead_running;
+static bool readahead_stop;
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t readahead_done = PTHREAD_COND_INITIALIZER;
+#endif
+
+static size_t readahead_size;
+
+static struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long waits;
+	unsigned long chunks;
+	unsigned long errors;
+} readahead_stats;
+
+int readahead_set_size(const char *size)
+{
+#if defined(LINUX) || defined(OSX)
+	char *end;
+	long val;
+
+	val = strtol(size, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > READAHEAD_SIZE_MAX)) {
+		fprintf(stderr, "Error - read-ahead cache size has to be between 1 and %d MiB: %s\n",
+			READAHEAD_SIZE_MAX, size);
+		return -1;
+	}
+
+	readahead_size = (size_t)val * 1024 * 1024;
+	return 0;
+#else
+	(void)size;
+	fprintf(stderr, "Error - read-ahead cache not supported on this platform\n");
+	return -1;
+#endif
+}
+
+bool readahead_enabled(void)
+{
+	return readahead_size != 0;
+}
+
+#if defined(LINUX) || defined(OSX)
+static ssize_t readahead_pread(int fd, char *dst, size_t len, size_t pos)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, dst + done, len - done, pos + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return -1;
+
+		if (ret == 0)
+			break;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+static void *readahead_thread_run(void *arg)
+{
+	struct readahead_chunk *chunk;
+	size_t index;
+	ssize_t ret;
+	int fd;
+
+	(void)arg;
+
+	pthread_mutex_lock(&readahead_lock);
+
+	for (;;) {
+		while (!queue_len && !readahead_stop)
+			pthread_cond_wait(&readahead_queued, &readahead_lock);
+
+		if (readahead_stop)
+			break;
+
+		chunk = queue[queue_head];
+		queue_head = (queue_head + 1) % chunk_count;
+		queue_len--;
+
+		chunk->state = READAHEAD_READING;
+		fd = chunk->fd;
+		index = chunk->index;
+		pthread_mutex_unlock(&readahead_lock);
+
+		ret = readahead_pread(fd, chunk->data, READAHEAD_CHUNK_LEN,
+				      index * READAHEAD_CHUNK_LEN);
+
+		pthread_mutex_lock(&readahead_lock);
+		if (ret <= 0) {
+			chunk->state = READAHEAD_UNUSED;
+			chunk->fd = -1;
+			readahead_stats.errors++;
+		} else {
+			chunk->state = READAHEAD_READY;
+			chunk->len = ret;
+			readahead_stats.chunks++;
+		}
+
+		pthread_cond_broadcast(&readahead_done);
+	}
+
+	pthread_mutex_unlock(&readahead_lock);
+
+	return NULL;
+}
+
+static void readahead_free(void)
+{
+	unsigned int i;
+
+	if (chunks) {
+		for (i = 0; i < chunk_count; i++)
+			free(chunks[i].data);
+	}
+
+	free(chunks);
+	chunks = NULL;
+	free(queue);
+	queue = NULL;
+	chunk_count = 0;
+	queue_head = 0;
+	queue_len = 0;
+}
+#endif
+
+int readahead_init(void)
+{
+#if defined(LINUX) || defined(OSX)
+	sigset_t mask, oldmask;
+	unsigned int i;
+	int ret;
+
+	if (!readahead_size || chunks)
+		return 0;
+
+	chunk_count = readahead_size / READAHEAD_CHUNK_LEN;
+	chunks = calloc(chunk_count, sizeof(*chunks));
+	queue = calloc(chunk_count, sizeof(*queue));
+	if (!chunks || !queue)
+		goto nomem;
+
+	for (i = 0; i < chunk_count; i++) {
+		chunks[i].fd = -1;
+		chunks[i].data = malloc(READAHEAD_CHUNK_LEN);
+		if (!chunks[i].data)
+			goto nomem;
+	}
+
+	/* signals are left to the main loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+	ret = pthread_create(&readahead_thread, NULL, readahead_thread_run,
+			     NULL);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (ret != 0) {
+		fprintf(stderr, "Error - can't start read-ahead thread: %s\n",
+			strerror(ret));
+		goto free;
+	}
+
+	readahead_running = true;
+	return 0;
+
+nomem:
+	fprintf(stderr, "Error - can't allocate %zu MiB for the read-ahead cache\n",
+		readahead_size / (1024 * 1024));
+free:
+	readahead_free();
+	return -1;
+#else
+	return 0;
+#endif
+}
+
+void readahead_exit(void)
+{
+#if defined(LINUX) || defined(OSX)
+	if (readahead_running) {
+		pthread_mutex_lock(&readahead_lock);
+		readahead_stop = true;
+		pthread_cond_signal(&readahead_queued);
+		pthread_mutex_unlock(&readahead_lock);
+
+		pthread_join(readahead_thread, NULL);
+		readahead_running = false;
+	}
+
+	readahead_free();
+#endif
+}
+
+#if defined(LINUX) || defined(OSX)
+static struct readahead_chunk *readahead_find(int fd, size_t index)
+{
+	unsigned int i;
+
+	for (i = 0; i < chunk_count; i++) {
+		if (chunks[i].state == READAHEAD_UNUSED)
+			continue;
+
+		if (chunks[i].fd == fd && chunks[i].index == index)
+			return &chunks[i];
+	}
+
+	return NULL;
+}
+
+/* queue a chunk for the background thread unless it is already there */
+static void readahead_queue(int fd, size_t index)
+{
+	struct readahead_chunk *chunk = NULL;
+	unsigned int i;
+
+	if (readahead_find(fd, index))
+		return;
+
+	for (i = 0; i < chunk_count; i++) {
+		if (chunks[i].state == READAHEAD_UNUSED) {
+			chunk = &chunks[i];
+			break;
+		}
+
+		if (chunks[i].state != READAHEAD_READY)
+			continue;
+
+		if (!chunk || chunks[i].last_use < chunk->last_use)
+			chunk = &chunks[i];
+	}
+
+	/* everything queued or being read */
+	if (!chunk)
+		return;
+
+	chunk->fd = fd;
+	chunk->index = index;
+	chunk->state = READAHEAD_QUEUED;
+	chunk->len = 0;
+	chunk->last_use = ++use_clock;
+
+	queue[(queue_head + queue_len) % chunk_count] = chunk;
+	queue_len++;
+	pthread_cond_signal(&readahead_queued);
+}
+
+static void readahead_queue_range(int fd, size_t file_len, size_t first,
+				  size_t last)
+{
+	for (; first <= last; first++) {
+		if (first * READAHEAD_CHUNK_LEN >= file_len)
+			break;
+
+		readahead_queue(fd, first);
+	}
+}
+#endif
+
+/**
+ * readahead_read() - read image data through the read-ahead cache
+ * @fd: file descriptor of the image - shared by all its readers
+ * @file_len: size of the image file
+ * @dst: buffer to copy the data to
+ * @pos: position in the file
+ * @len: number of bytes to read
+ *
+ * Return: len on success, -1 if the file couldn't be read
+ */
+int readahead_read(int fd, size_t file_len, char *dst, size_t pos, size_t len)
+{
+#if defined(LINUX) || defined(OSX)
+	struct readahead_chunk *chunk;
+	size_t index, first, chunk_pos, copy;
+	size_t end = pos + len;
+	int ret = (int)len;
+	ssize_t read_len;
+
+	first = pos / READAHEAD_CHUNK_LEN;
+
+	pthread_mutex_lock(&readahead_lock);
+
+	while (pos < end) {
+		index = pos / READAHEAD_CHUNK_LEN;
+		chunk_pos = pos % READAHEAD_CHUNK_LEN;
+		copy = READAHEAD_CHUNK_LEN - chunk_pos;
+		if (copy > end - pos)
+			copy = end - pos;
+
+		/* only this thread reuses chunks - it can't vanish meanwhile */
+		chunk = readahead_find(fd, index);
+		if (chunk && chunk->state == READAHEAD_READING) {
+			readahead_stats.waits++;
+			while (chunk->state == READAHEAD_READING)
+				pthread_cond_wait(&readahead_done,
+						  &readahead_lock);
+		}
+
+		if (chunk && chunk->state == READAHEAD_READY &&
+		    chunk->fd == fd && chunk->index == index &&
+		    chunk_pos + copy <= chunk->len) {
+			memcpy(dst, chunk->data + chunk_pos, copy);
+			chunk->last_use = ++use_clock;
+			readahead_stats.hits++;
+		} else {
+			pthread_mutex_unlock(&readahead_lock);
+			read_len = readahead_pread(fd, dst, copy, pos);
+			pthread_mutex_lock(&readahead_lock);
+
+			readahead_stats.misses++;
+			if (read_len != (ssize_t)copy) {
+				ret = -1;
+				break;
+			}
+		}
+
+		dst += copy;
+		pos += copy;
+	}
+
+	if (ret >= 0)
+		readahead_queue_range(fd, file_len, first,
+				      (end - 1) / READAHEAD_CHUNK_LEN + READAHEAD_AHEAD);
+
+	pthread_mutex_unlock(&readahead_lock);
+
+	return ret;
+#else
+	(void)fd;
+	(void)file_len;
+	(void)dst;
+	(void)pos;
+	(void)len;
+	return -1;
+#endif
+}
+
+/* have the background thread read a range before anyone asks for it */
+void readahead_prefetch(int fd, size_t file_len, size_t pos, size_t len)
+{
+#if defined(LINUX) || defined(OSX)
+	if (!chunks || !len)
+		return;
+
+	pthread_mutex_lock(&readahead_lock);
+	readahead_queue_range(fd, file_len, pos / READAHEAD_CHUNK_LEN,
+			      (pos + len - 1) / READAHEAD_CHUNK_LEN);
+	pthread_mutex_unlock(&readahead_lock);
+#else
+	(void)fd;
+	(void)file_len;
+	(void)pos;
+	(void)len;
+#endif
+}
+
+void readahead_print_stats(void)
+{
+	if (!readahead_size)
+		return;
+
+#if defined(LINUX) || defined(OSX)
+	pthread_mutex_lock(&readahead_lock);
+#endif
+	fprintf(stderr, "Read-ahead: %lu reads from cache (%lu waiting for it), %lu direct reads, %lu chunks read ahead, %lu read errors\n",
+		readahead_stats.hits, readahead_stats.waits,
+		readahead_stats.misses, readahead_stats.chunks,
+		readahead_stats.errors);
+#if defined(LINUX) || defined(OSX)
+	pthread_mutex_unlock(&readahead_lock);
+#endif
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) Marek Lindner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ * License-Filename: LICENSES/preferred/GPL-3.0
+ */
+
+#ifndef __AP51_FLASH_READAHEAD_H__
+#define __AP51_FLASH_READAHEAD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int readahead_set_size(const char *size);
+bool readahead_enabled(void);
+int readahead_init(void);
+void readahead_exit(void);
+int readahead_read(int fd, size_t file_len, char *dst, size_t pos,
+		   size_t len);
+void readahead_prefetch(int fd, size_t file_len, size_t pos, size_t len);
+void readahead_print_stats(void);
+
+#endif /* __AP51_FLASH_READAHEAD_H__ */
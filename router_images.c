@@ -29,9 +29,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(LINUX) || defined(OSX)
+#include <sys/mman.h>
+#endif
+
 #include "ap51-flash.h"
 #include "ap51-flash-res.h"
 #include "compat.h"
@@ -39,12 +44,21 @@
 #include "fwcfg.h"
 #include "list.h"
 #include "proto.h"
+#include "readahead.h"
 #include "router_types.h"
 
+/* image bytes covered by one entry of the checksum table */
+#define CSUM_GRANULE 16
+/* sequential reads used to preload images into memory */
+#define PRELOAD_READ_LEN (4 * 1024 * 1024)
+/* start of each file listed in fwupgrade.cfg warmed up front */
+#define PREFETCH_LEN (256 * 1024)
+
 static const char fwupgradecfg[] = "fwupgrade.cfg";
 static const char fwupgradecfgsig[] = "fwupgrade.cfg.sig";
 
-#define TFTP_PAYLOAD_SIZE 512
+static bool preload;
+
 
 #if defined(EMBED_UBOOT) && defined(LINUX)
 extern unsigned long _binary_img_uboot_start;
@@ -714,9 +728,233 @@ void router_images_print_desc(void)
 		fprintf(stderr, " * %s\n", (*router_image)->desc);
 }
 
+void router_images_set_preload(bool enable)
+{
+	preload = enable;
+}
+
+#if defined(LINUX) || defined(OSX)
+/* copy the whole image into locked memory - the file is never touched again */
+static int router_image_preload(struct router_image *router_image, int fd,
+				size_t size)
+{
+	bool progress = isatty(STDERR_FILENO);
+	unsigned int percent, last_percent = 101;
+	size_t done = 0, len;
+	ssize_t ret;
+	char *buff;
+
+	buff = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buff == MAP_FAILED) {
+		fprintf(stderr, "Error - can't allocate %zu bytes to preload image file '%s': %s\n",
+			size, router_image->path, strerror(errno));
+		return -1;
+	}
+
+	if (mlock(buff, size) < 0) {
+		fprintf(stderr, "Error - can't lock %zu bytes of memory to preload image file '%s': %s (check the available RAM and 'ulimit -l')\n",
+			size, router_image->path, strerror(errno));
+		goto unmap;
+	}
+
+	while (done < size) {
+		percent = (unsigned int)(done * 100 / size);
+		if (progress && percent != last_percent) {
+			fprintf(stderr, "\rPreloading image file '%s': %3u%%",
+				router_image->path, percent);
+			last_percent = percent;
+		}
+
+		len = size - done;
+		if (len > PRELOAD_READ_LEN)
+			len = PRELOAD_READ_LEN;
+
+		ret = pread(fd, buff + done, len, done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			if (progress)
+				fprintf(stderr, "\n");
+			fprintf(stderr, "Error - can't preload image file '%s': %s\n",
+				router_image->path,
+				ret < 0 ? strerror(errno) : "unexpected end of file");
+			goto unmap;
+		}
+
+		done += ret;
+	}
+
+	fprintf(stderr, "%sPreloading image file '%s': 100%% (%zu bytes)\n",
+		progress ? "\r" : "", router_image->path, size);
+
+	mprotect(buff, size, PROT_READ);
+
+	router_image->map = buff;
+	router_image->map_len = size;
+	router_image->map_preloaded = true;
+	return 0;
+
+unmap:
+	munmap(buff, size);
+	return -1;
+}
+#endif
+
+/* serve the image from memory instead of reading it per node and block */
+static int router_image_map(struct router_image *router_image, int fd)
+{
+#if defined(LINUX) || defined(OSX)
+	struct stat st;
+	void *map;
+
+	router_image->map_fd = -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0)
+		return 0;
+
+	if (preload)
+		return router_image_preload(router_image, fd, st.st_size);
+
+	/* streamed through the shared read-ahead cache */
+	if (readahead_enabled()) {
+		if (readahead_init() < 0)
+			return -1;
+
+		router_image->map_fd = dup(fd);
+		if (router_image->map_fd < 0) {
+			fprintf(stderr, "Error - can't keep image file '%s' open: %s\n",
+				router_image->path, strerror(errno));
+			return -1;
+		}
+
+		router_image->map_len = st.st_size;
+		router_image->map_dev = st.st_dev;
+		router_image->map_ino = st.st_ino;
+		router_image->map_readahead = true;
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Warning - can't map image file '%s': %s - reading it instead\n",
+			router_image->path, strerror(errno));
+		return 0;
+	}
+
+	/* all nodes read it front to back - more or less at the same time */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	/* keeps the mapped inode around for the size checks */
+	router_image->map_fd = dup(fd);
+	if (router_image->map_fd < 0) {
+		fprintf(stderr, "Error - can't keep image file '%s' open: %s\n",
+			router_image->path, strerror(errno));
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	router_image->map = map;
+	router_image->map_len = st.st_size;
+	router_image->map_dev = st.st_dev;
+	router_image->map_ino = st.st_ino;
+#else
+	(void)router_image;
+	(void)fd;
+#endif
+	return 0;
+}
+
+/* a file matching several image types is only mapped or preloaded once */
+static void router_image_map_share(struct router_image *router_image,
+				   const struct router_image *mapped)
+{
+#if defined(LINUX) || defined(OSX)
+	router_image->map = mapped->map;
+	router_image->map_len = mapped->map_len;
+	router_image->map_fd = mapped->map_fd;
+	router_image->map_dev = mapped->map_dev;
+	router_image->map_ino = mapped->map_ino;
+	router_image->map_preloaded = mapped->map_preloaded;
+	router_image->map_readahead = mapped->map_readahead;
+#else
+	(void)router_image;
+	(void)mapped;
+#endif
+}
+
+/* the mapped file must not have shrunk - reading it would raise SIGBUS */
+static int router_image_map_check(struct router_image *router_image)
+{
+#if defined(LINUX) || defined(OSX)
+	struct stat st;
+
+	/* a preloaded copy does not depend on the file anymore */
+	if ((!router_image->map && !router_image->map_readahead) ||
+	    router_image->map_preloaded)
+		return 0;
+
+	if ((router_image->map_fd < 0) || (fstat(router_image->map_fd, &st) < 0) ||
+	    ((size_t)st.st_size < router_image->map_len)) {
+		fprintf(stderr, "Error - image file '%s' was truncated - restart to serve the new image\n",
+			router_image->path);
+		return -1;
+	}
+
+	if (router_image->map_replaced)
+		return 0;
+
+	if ((stat(router_image->path, &st) == 0) &&
+	    ((st.st_dev != router_image->map_dev) ||
+	     (st.st_ino != router_image->map_ino))) {
+		fprintf(stderr, "Warning - image file '%s' was replaced - still serving the image loaded at startup\n",
+			router_image->path);
+		router_image->map_replaced = true;
+	}
+#else
+	(void)router_image;
+#endif
+	return 0;
+}
+
+/* start of the image data in memory - NULL if it has to be read */
+static const char *router_image_data(const struct router_image *router_image)
+{
+#if defined(LINUX) || defined(OSX)
+	if (router_image->map)
+		return router_image->map;
+#endif
+	if (router_image->path)
+		return NULL;
+
+	return router_image->embedded_img;
+}
+
+/* read through the read-ahead cache - nothing is opened per node either */
+static bool router_image_readahead(const struct router_image *router_image)
+{
+#if defined(LINUX) || defined(OSX)
+	return router_image->map_readahead;
+#else
+	(void)router_image;
+	return false;
+#endif
+}
+
+static size_t router_image_data_len(const struct router_image *router_image)
+{
+#if defined(LINUX) || defined(OSX)
+	if (router_image->map)
+		return router_image->map_len;
+#endif
+	return SIZE_MAX;
+}
+
 int router_images_verify_path(const char *image_path)
 {
-	struct router_image **router_image;
+	struct router_image **router_image, *mapped = NULL;
 	char *file_buff = NULL, found_consumer = 0;
 	unsigned int file_buff_size = 64 * 1024; // max CE hdr size
 	int fd, file_size, ret = -1, len;
@@ -764,6 +1002,18 @@ int router_images_verify_path(const char *image_path)
 
 		found_consumer = 1;
 
+		if (mapped) {
+			router_image_map_share(*router_image, mapped);
+		} else {
+			ret = router_image_map(*router_image, fd);
+			if (ret < 0) {
+				(*router_image)->path = NULL;
+				goto close_fd;
+			}
+
+			mapped = *router_image;
+		}
+
 #if defined(DEBUG)
 		printf("verify image path: %s: %s (%i bytes)\n",
 		       image_path, (*router_image)->desc,
@@ -794,6 +1044,15 @@ int router_images_open_path(struct node *node)
 		    goto out;
 	}
 
+	/* mapped or read-ahead image - nothing to open per node */
+	if (router_image_data(node->router_type->image) ||
+	    router_image_readahead(node->router_type->image)) {
+		node->image_state.fd = -1;
+		if (router_image_map_check(node->router_type->image) == 0)
+			node->image_state.fd = 1;
+		goto out;
+	}
+
 	node->image_state.fd = open(node->router_type->image->path,
 				    O_RDONLY | O_BINARY);
 	if (node->image_state.fd < 0)
@@ -806,11 +1065,12 @@ int router_images_open_path(struct node *node)
 
 int router_images_read_data(char *dst, struct node *node)
 {
-	int len = TFTP_PAYLOAD_SIZE, read_len;
-	uint8_t *file_data;
+	int len = node->image_state.block_size, read_len;
+	const uint8_t *file_data;
+	const char *image_data;
 	off_t reto;
 
-	if (node->image_state.flash_size - node->image_state.bytes_sent < TFTP_PAYLOAD_SIZE)
+	if (node->image_state.flash_size - node->image_state.bytes_sent < node->image_state.block_size)
 		len = node->image_state.flash_size - node->image_state.bytes_sent;
 
 	read_len = len;
@@ -820,7 +1080,45 @@ int router_images_read_data(char *dst, struct node *node)
 	else if (node->image_state.file_size < node->image_state.bytes_sent + len)
 		read_len = node->image_state.file_size - node->image_state.bytes_sent;
 
-	if (node->router_type->image->path) {
+	/* embedded or mapped image */
+	image_data = router_image_data(node->router_type->image);
+	if (image_data) {
+		if ((read_len > 0) &&
+		    ((size_t)node->image_state.offset + node->image_state.bytes_sent + read_len >
+		     router_image_data_len(node->router_type->image))) {
+			fprintf(stderr, "Error - reading beyond the end of image '%s'\n",
+				node->router_type->image->desc);
+			return -1;
+		}
+
+		file_data = (const uint8_t *)image_data;
+		file_data += node->image_state.bytes_sent;
+		file_data += node->image_state.offset;
+
+		if (read_len > 0)
+			memcpy(dst, file_data, read_len);
+
+		if (read_len != len)
+			memset(dst + read_len, 0, len - read_len);
+
+		return len;
+	} else if (router_image_readahead(node->router_type->image)) {
+		if ((read_len > 0) &&
+		    (readahead_read(node->router_type->image->map_fd,
+				    node->router_type->image->map_len, dst,
+				    node->image_state.offset + node->image_state.bytes_sent,
+				    read_len) < 0)) {
+			fprintf(stderr, "Error - reading from file '%s': %s\n",
+				node->router_type->image->path,
+				strerror(errno));
+			return -1;
+		}
+
+		if (read_len != len)
+			memset(dst + read_len, 0, len - read_len);
+
+		return len;
+	} else if (node->router_type->image->path) {
 		if (node->image_state.fd < 0) {
 #if defined(DEBUG)
 			fprintf(stderr, "router_images_read_data(): image has file path but no open fd ??\n");
@@ -851,22 +1149,137 @@ int router_images_read_data(char *dst, struct node *node)
 			memset(dst + read_len, 0, len - read_len);
 
 		return len;
-	} else if (node->router_type->image->embedded_img) {
-		file_data = (uint8_t *)node->router_type->image->embedded_img;
-		file_data += node->image_state.bytes_sent;
-		file_data += node->image_state.offset;
+	}
 
-		if (read_len > 0)
-			memcpy(dst, file_data, read_len);
+err:
+	return -1;
+}
 
-		if (read_len != len)
-			memset(dst + read_len, 0, len - read_len);
+/* the byte at an even position is the upper half of a 16 bit word */
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, unsigned int pos,
+			 unsigned int len)
+{
+	unsigned int i;
 
-		return len;
+	for (i = 0; i < len; i++)
+		sum += ((pos + i) & 1) ? data[i] : data[i] << 8;
+
+	return sum;
+}
+
+static unsigned short csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/* end of the image data served to the devices */
+static unsigned int router_image_data_end(const struct router_image *router_image)
+{
+	struct file_info *file_info;
+	struct list *list;
+	unsigned int end = router_image->file_size;
+
+	slist_for_each (list, router_image->file_list) {
+		file_info = (struct file_info *)list->data;
+
+		if (file_info->file_offset + file_info->file_size > end)
+			end = file_info->file_offset + file_info->file_size;
 	}
 
-err:
-	return -1;
+	return end;
+}
+
+/*
+ * sums up the whole image once - shared by all nodes and block sizes
+ *
+ * Only images in memory get a table: reading a streamed image for it would
+ * block the packet path and could sum up a file other than the one served.
+ * Their blocks are summed up as they were read.
+ */
+static void router_image_csum_init(struct router_image *router_image)
+{
+	const uint8_t *data;
+	unsigned int end, num, i;
+	uint32_t sum = 0;
+
+	router_image->csum_table_init = true;
+
+	data = (const uint8_t *)router_image_data(router_image);
+	if (!data)
+		return;
+
+	end = router_image_data_end(router_image);
+	if (end > router_image_data_len(router_image))
+		end = router_image_data_len(router_image);
+
+	num = end / CSUM_GRANULE + 1;
+	router_image->csum_table = malloc(num * sizeof(uint16_t));
+	if (!router_image->csum_table)
+		return;
+
+	router_image->csum_table[0] = 0;
+
+	for (i = 1; i < num; i++) {
+		sum = csum_fold(csum_add(sum, data, (i - 1) * CSUM_GRANULE,
+					 CSUM_GRANULE));
+		router_image->csum_table[i] = sum;
+		data += CSUM_GRANULE;
+	}
+
+	router_image->csum_table_len = num;
+}
+
+/**
+ * router_images_data_csum - one's complement sum of a block of image data
+ * @node: node the block was read for by router_images_read_data()
+ * @data: the block
+ * @len: length of the block
+ *
+ * Only the bytes before and after the checksum table granules are summed up,
+ * the rest is taken from the table of the image.
+ */
+unsigned short router_images_data_csum(struct node *node, const char *data,
+				       int len)
+{
+	struct router_image *router_image = node->router_type->image;
+	unsigned int start, end, gstart, gend, data_len = len;
+	uint32_t sum, mid;
+
+	/* the padding up to the flash size is zero */
+	if (node->image_state.file_size < node->image_state.bytes_sent)
+		data_len = 0;
+	else if (node->image_state.file_size < node->image_state.bytes_sent + len)
+		data_len = node->image_state.file_size - node->image_state.bytes_sent;
+
+	if (!router_image->csum_table_init)
+		router_image_csum_init(router_image);
+
+	start = node->image_state.offset + node->image_state.bytes_sent;
+	end = start + data_len;
+	gstart = (start + CSUM_GRANULE - 1) / CSUM_GRANULE;
+	gend = end / CSUM_GRANULE;
+
+	if ((!router_image->csum_table) || (gend <= gstart) ||
+	    (gend >= router_image->csum_table_len))
+		return csum_fold(csum_add(0, (const uint8_t *)data, 0, data_len));
+
+	sum = csum_add(0, (const uint8_t *)data, 0,
+		       gstart * CSUM_GRANULE - start);
+	sum = csum_add(sum, (const uint8_t *)data + gend * CSUM_GRANULE - start,
+		       gend * CSUM_GRANULE - start, end - gend * CSUM_GRANULE);
+
+	/* one's complement difference of the sums up to both ends */
+	mid = csum_fold(router_image->csum_table[gend] +
+			(~router_image->csum_table[gstart] & 0xffff));
+
+	/* the block starts in the middle of a 16 bit word of the image */
+	if (start & 1)
+		mid = ((mid & 0xff) << 8) | (mid >> 8);
+
+	return csum_fold(sum + mid);
 }
 
 bool router_images_available(void)
@@ -881,9 +1294,81 @@ bool router_images_available(void)
 	return false;
 }
 
+static void router_image_prefetch_range(struct node *node, size_t pos,
+					size_t len)
+{
+	struct router_image *router_image = node->router_type->image;
+#if defined(LINUX) || defined(OSX)
+	size_t page_size, start;
+
+	/* nothing to wait for */
+	if (router_image->map_preloaded || !router_image->path)
+		return;
+
+	if (router_image->map_readahead) {
+		readahead_prefetch(router_image->map_fd, router_image->map_len,
+				   pos, len);
+		return;
+	}
+
+	if (router_image->map) {
+		if (pos >= router_image->map_len)
+			return;
+
+		if (len > router_image->map_len - pos)
+			len = router_image->map_len - pos;
+
+		page_size = sysconf(_SC_PAGESIZE);
+		start = pos & ~(page_size - 1);
+		madvise((char *)router_image->map + start, len + pos - start,
+			MADV_WILLNEED);
+		return;
+	}
+#endif
+#if defined(LINUX)
+	if (router_image->path && node->image_state.fd > 0)
+		posix_fadvise(node->image_state.fd, pos, len,
+			      POSIX_FADV_WILLNEED);
+#else
+	(void)router_image;
+	(void)pos;
+	(void)len;
+#endif
+}
+
+/**
+ * router_images_prefetch() - warm up the files a node is going to ask for
+ * @node: node which requested @file_info
+ * @file_info: requested file - only fwupgrade.cfg lists further files
+ *
+ * CE devices fetch their fwupgrade.cfg first and then every file it lists.
+ * The start of each of these files is read in the background right away,
+ * so none of the requests has to wait for the disk.
+ */
+void router_images_prefetch(struct node *node,
+			    const struct file_info *file_info)
+{
+	const struct file_info *next;
+	unsigned int i, len;
+
+	for (i = 0; i < file_info->fwcfg_file_count; i++) {
+		next = file_info->fwcfg_files[i];
+
+		len = next->file_size;
+		if (len > PREFETCH_LEN)
+			len = PREFETCH_LEN;
+
+		if (len > 0)
+			router_image_prefetch_range(node, next->file_offset,
+						    len);
+	}
+}
+
 void router_images_close_path(struct node *node)
 {
 	if ((node->router_type->image->path) &&
+	    (!router_image_data(node->router_type->image)) &&
+	    (!router_image_readahead(node->router_type->image)) &&
 	    (node->image_state.fd > 0))
 		close(node->image_state.fd);
 
@@ -23,6 +23,9 @@
 #define __AP51_FLASH_ROUTER_IMAGES_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "ap51-flash.h"
 
@@ -57,6 +60,21 @@ struct router_image {
 	unsigned int file_size;
 	struct list *file_list;
 	struct list *router_list;
+#if defined(LINUX) || defined(OSX)
+	/* path images are mapped once and shared by all nodes */
+	const char *map;
+	size_t map_len;
+	int map_fd;
+	dev_t map_dev;
+	ino_t map_ino;
+	bool map_replaced;
+	bool map_preloaded;
+	bool map_readahead;
+#endif
+	/* one's complement sums of the first n * CSUM_GRANULE image bytes */
+	uint16_t *csum_table;
+	unsigned int csum_table_len;
+	bool csum_table_init;
 };
 
 struct router_info {
@@ -69,6 +87,9 @@ struct file_info {
 	unsigned int file_offset;
 	unsigned int file_size;
 	unsigned int file_fsize;
+	/* files listed by this fwupgrade.cfg - requested next, in this order */
+	struct file_info **fwcfg_files;
+	unsigned int fwcfg_file_count;
 };
 
 struct router_info *router_image_router_get(struct router_image *router_image,
@@ -79,9 +100,14 @@ void router_images_init(void);
 void router_images_init_embedded(void);
 bool router_images_available(void);
 void router_images_print_desc(void);
+void router_images_set_preload(bool enable);
 int router_images_verify_path(const char *image_path);
 int router_images_open_path(struct node *node);
 int router_images_read_data(char *dst, struct node *node);
+unsigned short router_images_data_csum(struct node *node, const char *data,
+				       int len);
+void router_images_prefetch(struct node *node,
+			    const struct file_info *file_info);
 void router_images_close_path(struct node *node);
 unsigned int router_image_get_size(struct router_type *router_type);
 struct file_info *router_image_get_file_info(struct router_image *router_image,
@@ -55,8 +55,11 @@ enum redboot_state {
 
 static const unsigned int ubnt_ip = 3232235796UL; /* 192.168.1.20 */
 
-struct redboot_priv {
+struct redboot_detect_priv {
 	int arp_count;
+};
+
+struct redboot_priv {
 	enum redboot_state redboot_state;
 	struct redboot_type *redboot_type;
 	char *version_info;
@@ -169,6 +172,7 @@ void redboot_main(struct node *node, const char *telnet_msg)
 		telnet_send_cmd(node, "version\n");
 		break;
 	case REDBOOT_STATE_VERSION:
+		free(redboot_priv->version_info);
 		redboot_priv->version_info = malloc(strlen(telnet_msg) + 1);
 		if (!redboot_priv->version_info)
 			goto redboot_failure;
@@ -302,7 +306,7 @@ void redboot_main(struct node *node, const char *telnet_msg)
 	case REDBOOT_STATE_EXECY:
 		telnet_send_cmd(node, "reset\n");
 		redboot_priv->redboot_state = REDBOOT_STATE_FINISHED;
-		node->status = NODE_STATUS_RESET_SENT;
+		node_status_set(node, NODE_STATUS_RESET_SENT);
 		break;
 	default:
 		break;
@@ -320,7 +324,7 @@ static int redboot_detect_main(void *priv, const char *packet_buff,
 			       int packet_buff_len)
 {
 	struct ether_arp *arphdr;
-	struct redboot_priv *redboot_priv = priv;
+	struct redboot_detect_priv *redboot_priv = priv;
 	int ret = 0;
 
 	if (!len_check(packet_buff_len, sizeof(struct ether_arp), "ARP"))
@@ -341,6 +345,7 @@ static int redboot_detect_main(void *priv, const char *packet_buff,
 	if (*((unsigned int *)arphdr->arp_spa) == htonl(ubnt_ip)) {
 		if (redboot_priv->arp_count < 5) {
 			redboot_priv->arp_count++;
+			ret = 2;
 			goto out;
 		}
 	}
@@ -377,11 +382,21 @@ static void redboot_detect_post(struct node *node, const char *packet_buff,
 	return;
 }
 
+static void redboot_free(struct node *node)
+{
+	struct redboot_priv *redboot_priv = node->router_priv;
+
+	free(redboot_priv->version_info);
+	redboot_priv->version_info = NULL;
+}
+
 const struct router_type redboot = {
 	.desc = "redboot",
 	.detect_pre = NULL,
 	.detect_main = redboot_detect_main,
 	.detect_post = redboot_detect_post,
+	.free = redboot_free,
 	.image = &img_ci,
+	.detect_priv_size = sizeof(struct redboot_detect_priv),
 	.priv_size = sizeof(struct redboot_priv),
 };
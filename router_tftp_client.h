@@ -41,7 +41,6 @@ extern const struct router_type  om5pan;
 extern const struct router_type  p60;
 extern const struct router_type  zyxel;
 
-void tftp_client_flash_time_set(struct node *node);
-int tftp_client_flash_completed(struct node *node);
+unsigned int tftp_client_flash_time(const struct node *node);
 
 #endif /* __AP51_FLASH_ROUTER_TFTP_CLIENT_H__ */
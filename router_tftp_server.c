@@ -32,7 +32,7 @@
 static const unsigned int ubnt_ip = 3232235796UL; /* 192.168.1.20 */
 static const unsigned int my_ip = 3232235801UL;  /* 192.168.1.25 */
 
-struct ubnt_priv {
+struct ubnt_detect_priv {
 	int arp_count;
 };
 
@@ -47,7 +47,7 @@ static int ubnt_detect_main(void *priv, const char *packet_buff,
 			    int packet_buff_len)
 {
 	struct ether_arp *arphdr;
-	struct ubnt_priv *ubnt_priv = priv;
+	struct ubnt_detect_priv *ubnt_priv = priv;
 	int ret = 0;
 
 	if (!len_check(packet_buff_len, sizeof(struct ether_arp), "ARP"))
@@ -62,6 +62,7 @@ static int ubnt_detect_main(void *priv, const char *packet_buff,
 
 	if (ubnt_priv->arp_count < 20) {
 		ubnt_priv->arp_count++;
+		ret = 2;
 		goto out;
 	}
 
@@ -95,5 +96,5 @@ const struct router_type ubnt = {
 	.detect_main = ubnt_detect_main,
 	.detect_post = ubnt_detect_post,
 	.image = &img_ubnt,
-	.priv_size = sizeof(struct ubnt_priv),
+	.detect_priv_size = sizeof(struct ubnt_detect_priv),
 };
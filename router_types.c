@@ -21,21 +21,19 @@
 
 #include "router_types.h"
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "compat.h"
 #include "flash.h"
 #include "router_images.h"
 #include "router_redboot.h"
 #include "router_tftp_client.h"
 #include "router_tftp_server.h"
 
-#if defined(CLEAR_SCREEN)
-#if defined(LINUX) || defined(WIN32)
-#include <stdlib.h>
-#endif
-#endif
-
-int router_types_priv_size = 0;
+int router_types_detect_priv_size = 0;
 
 static const struct router_type *router_types[] = {
 	&a40,
@@ -59,11 +57,218 @@ static const struct router_type *router_types[] = {
 	NULL,
 };
 
+#define ROUTER_TYPES_NUM (sizeof(router_types) / sizeof(router_types[0]) - 1)
+
+/**
+ * The ARP signatures of all router types are compiled into an open
+ * addressing hash table keyed on opcode, target IP and target hardware
+ * address prefix. A packet is looked up once for each distinct prefix
+ * length (longest first), so classifying an ARP packet does not get more
+ * expensive with every router type added.
+ */
+struct arp_sig_entry {
+	const struct router_arp_sig *sig;
+	const struct router_type *router_type;
+};
+
+static struct arp_sig_entry *arp_sig_table = NULL;
+static unsigned int arp_sig_table_size = 0;
+static uint8_t arp_sig_lens[7];
+static unsigned int arp_sig_num_lens = 0;
+
+/* router types which need per node state to be detected */
+struct detect_main_entry {
+	const struct router_type *router_type;
+	int priv_offset;
+};
+
+static struct detect_main_entry detect_main_types[ROUTER_TYPES_NUM];
+static unsigned int detect_main_num = 0;
+
+static uint32_t arp_sig_hash(uint16_t op, uint32_t tpa, const uint8_t *tha,
+			     uint8_t tha_len)
+{
+	uint32_t hash = 2166136261UL;
+	uint8_t i;
+
+	hash = (hash ^ op) * 16777619;
+	hash = (hash ^ tpa) * 16777619;
+	hash = (hash ^ tha_len) * 16777619;
+
+	for (i = 0; i < tha_len; i++)
+		hash = (hash ^ tha[i]) * 16777619;
+
+	return hash ^ (hash >> 16);
+}
+
+static bool arp_sig_match(const struct router_arp_sig *sig, uint16_t op,
+			  uint32_t tpa, const uint8_t *tha, uint8_t tha_len)
+{
+	if (sig->tha_len != tha_len)
+		return false;
+
+	if (sig->op != op || sig->tpa != tpa)
+		return false;
+
+	return memcmp(sig->tha, tha, tha_len) == 0;
+}
+
+static struct arp_sig_entry *arp_sig_slot(uint16_t op, uint32_t tpa,
+					  const uint8_t *tha, uint8_t tha_len)
+{
+	struct arp_sig_entry *entry;
+	uint32_t index;
+
+	index = arp_sig_hash(op, tpa, tha, tha_len) & (arp_sig_table_size - 1);
+
+	while (1) {
+		entry = &arp_sig_table[index];
+		if (!entry->sig)
+			break;
+
+		if (arp_sig_match(entry->sig, op, tpa, tha, tha_len))
+			break;
+
+		index = (index + 1) & (arp_sig_table_size - 1);
+	}
+
+	return entry;
+}
+
+static int arp_sig_add(const struct router_type *router_type,
+		       const struct router_arp_sig *sig)
+{
+	struct arp_sig_entry *entry;
+	unsigned int i;
+	int ret = -1;
+
+	if (sig->tha_len > sizeof(sig->tha)) {
+		fprintf(stderr,
+			"Error - invalid ARP signature hardware address length: %s\n",
+			router_type->desc);
+		goto out;
+	}
+
+	entry = arp_sig_slot(sig->op, sig->tpa, sig->tha, sig->tha_len);
+	if (entry->sig) {
+		fprintf(stderr,
+			"Error - ARP signature of %s already used by %s\n",
+			router_type->desc, entry->router_type->desc);
+		goto out;
+	}
+
+	entry->sig = sig;
+	entry->router_type = router_type;
+
+	/* keep the prefix lengths sorted, longest first */
+	for (i = 0; i < arp_sig_num_lens; i++) {
+		if (arp_sig_lens[i] == sig->tha_len)
+			break;
+
+		if (arp_sig_lens[i] > sig->tha_len)
+			continue;
+
+		memmove(&arp_sig_lens[i + 1], &arp_sig_lens[i],
+			arp_sig_num_lens - i);
+		arp_sig_lens[i] = sig->tha_len;
+		arp_sig_num_lens++;
+		break;
+	}
+
+	if (i == arp_sig_num_lens)
+		arp_sig_lens[arp_sig_num_lens++] = sig->tha_len;
+
+	ret = 0;
+
+out:
+	return ret;
+}
+
+static int arp_sig_table_init(void)
+{
+	const struct router_type **router_type;
+	const struct router_arp_sig *sig;
+	unsigned int num_sigs = 0;
+	int ret = -1;
+
+	for (router_type = router_types; *router_type; ++router_type) {
+		if (!(*router_type)->arp_sigs)
+			continue;
+
+		for (sig = (*router_type)->arp_sigs; sig->op; sig++)
+			num_sigs++;
+	}
+
+	/* keep the table at most half full */
+	arp_sig_table_size = 8;
+	while (arp_sig_table_size < num_sigs * 2)
+		arp_sig_table_size <<= 1;
+
+	arp_sig_table = calloc(arp_sig_table_size, sizeof(*arp_sig_table));
+	if (!arp_sig_table) {
+		fprintf(stderr, "Error - can't allocate ARP signature table\n");
+		goto out;
+	}
+
+	arp_sig_num_lens = 0;
+
+	for (router_type = router_types; *router_type; ++router_type) {
+		if (!(*router_type)->arp_sigs)
+			continue;
+
+		for (sig = (*router_type)->arp_sigs; sig->op; sig++) {
+			if (arp_sig_add(*router_type, sig) < 0)
+				goto free_table;
+		}
+	}
+
+	ret = 0;
+	goto out;
+
+free_table:
+	free(arp_sig_table);
+	arp_sig_table = NULL;
+out:
+	return ret;
+}
+
+static const struct router_type *arp_sig_find(const char *packet_buff,
+					      int packet_buff_len)
+{
+	const struct router_type *router_type = NULL;
+	struct arp_sig_entry *entry;
+	struct ether_arp *arphdr;
+	unsigned int i;
+	uint16_t op;
+	uint32_t tpa;
+
+	if (packet_buff_len < (int)sizeof(struct ether_arp))
+		goto out;
+
+	arphdr = (struct ether_arp *)packet_buff;
+	op = ntohs(arphdr->ea_hdr.ar_op);
+	tpa = ntohl(*((unsigned int *)arphdr->arp_tpa));
+
+	for (i = 0; i < arp_sig_num_lens; i++) {
+		entry = arp_sig_slot(op, tpa, arphdr->arp_tha, arp_sig_lens[i]);
+		if (!entry->sig)
+			continue;
+
+		router_type = entry->router_type;
+		break;
+	}
+
+out:
+	return router_type;
+}
+
 int router_types_init(void)
 {
 	int ret = -1;
 	const struct router_type **router_type;
 
+	detect_main_num = 0;
+
 	for (router_type = router_types; *router_type; ++router_type) {
 		if (!(*router_type)->image) {
 			fprintf(stderr,
@@ -72,15 +277,27 @@ int router_types_init(void)
 			goto out;
 		}
 
-		router_types_priv_size += (*router_type)->priv_size;
+		if ((*router_type)->detect_main) {
+			detect_main_types[detect_main_num].router_type = *router_type;
+			detect_main_types[detect_main_num].priv_offset = router_types_detect_priv_size;
+			detect_main_num++;
+		}
+
+		router_types_detect_priv_size += (*router_type)->detect_priv_size;
 	}
 
-	ret = 0;
+	ret = arp_sig_table_init();
 
 out:
 	return ret;
 }
 
+void router_types_free(void)
+{
+	free(arp_sig_table);
+	arp_sig_table = NULL;
+}
+
 void router_types_detect_pre(const uint8_t *our_mac)
 {
 	const struct router_type **router_type;
@@ -93,88 +310,119 @@ void router_types_detect_pre(const uint8_t *our_mac)
 	}
 }
 
-int router_types_detect_main(struct node *node, const char *packet_buff,
-			     int packet_buff_len)
+static int router_types_detected(struct node *node,
+				 const struct router_type *router_type,
+				 const char *packet_buff, int packet_buff_len)
 {
-	const struct router_type **router_type;
 	struct router_info *router_info;
-	void *priv = node + 1;
 	int ret = 0;
 
-	for (router_type = router_types; *router_type; ++router_type) {
-		if (!(*router_type)->detect_main)
-			goto next;
-
-		ret = (*router_type)->detect_main(priv, packet_buff,
-						  packet_buff_len);
-		if (ret != 1)
-			goto next;
-
-		/* we detected a router that we have no image for */
-		if ((*router_type)->image->file_size < 1) {
-			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: is of type '%s' that we have no image for\n",
-				node->his_mac_addr[0], node->his_mac_addr[1],
-				node->his_mac_addr[2], node->his_mac_addr[3],
-				node->his_mac_addr[4], node->his_mac_addr[5],
-				(*router_type)->desc);
+	/* we detected a router that we have no image for */
+	if (router_type->image->file_size < 1) {
+		fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: is of type '%s' that we have no image for\n",
+			node->his_mac_addr[0], node->his_mac_addr[1],
+			node->his_mac_addr[2], node->his_mac_addr[3],
+			node->his_mac_addr[4], node->his_mac_addr[5],
+			router_type->desc);
 
-			node->status = NODE_STATUS_NO_FLASH;
-			ret = 0;
-			break;
+		node_status_set(node, NODE_STATUS_NO_FLASH);
+		goto out;
+	}
+
+	if (router_type->image->type == IMAGE_TYPE_CE) {
+		router_info = router_image_router_get(router_type->image,
+						      router_type->image_desc ? (char *)router_type->image_desc : (char *)router_type->desc);
+		if (!router_info) {
+			fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: is of type '%s' that we have no image for (ce)\n",
+				node->his_mac_addr[0],
+				node->his_mac_addr[1],
+				node->his_mac_addr[2],
+				node->his_mac_addr[3],
+				node->his_mac_addr[4],
+				node->his_mac_addr[5],
+				router_type->desc);
+
+			node_status_set(node, NODE_STATUS_NO_FLASH);
+			goto out;
 		}
+	}
+
+	/* the MR500 is detected again after each flash */
+	if (node->router_type && node->router_type->free)
+		node->router_type->free(node);
+
+	free(node->router_priv);
+	node->router_priv = NULL;
 
-		if ((*router_type)->image->type == IMAGE_TYPE_CE) {
-			router_info = router_image_router_get((*router_type)->image,
-							      (*router_type)->image_desc ? (char *)(*router_type)->image_desc : (char *)(*router_type)->desc);
-			if (!router_info) {
-				fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: is of type '%s' that we have no image for (ce)\n",
-					node->his_mac_addr[0],
-					node->his_mac_addr[1],
-					node->his_mac_addr[2],
-					node->his_mac_addr[3],
-					node->his_mac_addr[4],
-					node->his_mac_addr[5],
-					(*router_type)->desc);
-
-				node->status = NODE_STATUS_NO_FLASH;
-				ret = 0;
-				break;
-			}
+	if (router_type->priv_size > 0) {
+		node->router_priv = calloc(1, router_type->priv_size);
+		if (!node->router_priv) {
+			fprintf(stderr, "Error - can't allocate router private data\n");
+			goto out;
 		}
+	}
 
-		our_mac_set(node);
-		node->router_type = (struct router_type *)(*router_type);
-		node->router_priv = priv;
+	our_mac_set(node);
+	node->router_type = (struct router_type *)router_type;
 
 #if defined(CLEAR_SCREEN)
 #if defined(LINUX)
-		if (num_nodes_flashed > 0)
-			ret = system("clear");
+	if (num_nodes_flashed > 0)
+		ret = system("clear");
 #elif defined(WIN32)
-		if (num_nodes_flashed > 0)
-			ret = system("cls");
+	if (num_nodes_flashed > 0)
+		ret = system("cls");
 #else
 #error CLEAR_SCREEN is not supported on your OS
 #endif
-		/* keep gcc happy by retrieving the return value of the system() call */
-		ret = 1;
 #endif
 
-		fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: type '%s router' detected\n",
-			node->his_mac_addr[0], node->his_mac_addr[1],
-			node->his_mac_addr[2], node->his_mac_addr[3],
-			node->his_mac_addr[4], node->his_mac_addr[5],
-			node->router_type->desc);
+	fprintf(stderr, "[%02x:%02x:%02x:%02x:%02x:%02x]: type '%s router' detected\n",
+		node->his_mac_addr[0], node->his_mac_addr[1],
+		node->his_mac_addr[2], node->his_mac_addr[3],
+		node->his_mac_addr[4], node->his_mac_addr[5],
+		node->router_type->desc);
 
-		if (!(*router_type)->detect_post)
-			break;
+	if (router_type->detect_post)
+		router_type->detect_post(node, packet_buff, packet_buff_len);
 
-		(*router_type)->detect_post(node, packet_buff, packet_buff_len);
-		break;
+	ret = 1;
 
-next:
-		priv = (char *)priv + (*router_type)->priv_size;
+out:
+	return ret;
+}
+
+int router_types_detect_main(struct node *node, const char *packet_buff,
+			     int packet_buff_len)
+{
+	const struct router_type *router_type;
+	char *priv = (char *)(node + 1);
+	bool candidate = false;
+	unsigned int i;
+	int ret = 0;
+
+	router_type = arp_sig_find(packet_buff, packet_buff_len);
+	if (router_type)
+		goto detected;
+
+	for (i = 0; i < detect_main_num; i++) {
+		router_type = detect_main_types[i].router_type;
+
+		ret = router_type->detect_main(priv + detect_main_types[i].priv_offset,
+					       packet_buff, packet_buff_len);
+		if (ret == 1)
+			goto detected;
+
+		if (ret == 2)
+			candidate = true;
 	}
 
+	ret = candidate ? 2 : 0;
+	goto out;
+
+detected:
+	ret = router_types_detected(node, router_type, packet_buff,
+				    packet_buff_len);
+out:
 	return ret;
 }
@@ -28,34 +28,64 @@
 
 struct node;
 
+/**
+ * static ARP signature of a router type
+ *
+ * op: ARP opcode (host byte order), 0 terminates a signature list
+ * tpa: target protocol address (host byte order)
+ * tha: expected prefix of the target hardware address
+ * tha_len: number of tha bytes which have to match (0 - 6)
+ */
+struct router_arp_sig {
+	uint16_t op;
+	uint32_t tpa;
+	uint8_t tha[6];
+	uint8_t tha_len;
+};
+
 /**
  * each router type has to declare a router_type struct
  * and add a pointer to the router_types array
  *
  * detect_pre: called by the scheduler in regular intervals
  *             can be used to send ARP requests
- * detect_main: called when an ARP packet is received
- *              return 1 if the router has been detected
+ * arp_sigs: list of ARP signatures identifying the router
+ *           compiled into a lookup table by router_types_init(),
+ *           a single matching ARP detects the router
+ * detect_main: called when an ARP packet matched no signature
+ *              (for routers which need state to be detected)
+ *              return 1 if the router has been detected, 2 if the
+ *              packet could be from the router but more are needed
+ *              gets the router_type's detect_priv_size bytes of
+ *              per node scratch space (zeroed when the node is created)
  * detect_post: called to let the router_type configure
  *              the node#s settings (e.g. IP)
+ * free: called before a detected node is released
+ *       has to free everything allocated in the node's router_priv
+ * priv_size: size of the node's router_priv, allocated once the
+ *            router_type has been detected
  */
 struct router_type {
 	char desc[DESC_MAX_LENGTH];
 	void (*detect_pre)(const uint8_t *our_mac);
+	const struct router_arp_sig *arp_sigs;
 	int (*detect_main)(void *priv, const char *packet_buff,
 			   int packet_buff_len);
 	void (*detect_post)(struct node *node, const char *packet_buff,
 			    int packet_buff_len);
+	void (*free)(struct node *node);
 	struct router_image *image;
 	char *image_desc;
+	int detect_priv_size;
 	int priv_size;
 };
 
 int router_types_init(void);
+void router_types_free(void);
 void router_types_detect_pre(const uint8_t *our_mac);
 int router_types_detect_main(struct node *node, const char *packet_buff,
 			     int packet_buff_len);
 
-extern int router_types_priv_size;
+extern int router_types_detect_priv_size;
 
 #endif /* __AP51_FLASH_ROUTER_TYPES_H__ */
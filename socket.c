@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,15 +36,94 @@
 #include "list.h"
 #endif
 
+#if defined(LINUX)
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#define RX_BUFF_LEN 2000
+#define TX_BUFF_LEN 2000
+#define BATCH_SIZE_DEFAULT 16
+#define BATCH_SIZE_MAX 256
+#define SOCKET_DRAIN_MAX 256
+
+/* frames handled per socket_read() / socket_flush() call */
+struct batch_stats {
+	unsigned long batches;
+	unsigned long frames;
+	unsigned int max;
+};
+
+static enum socket_rx_mode rx_mode = SOCKET_RX_MODE_READ;
+static enum socket_tx_mode tx_mode = SOCKET_TX_MODE_WRITE;
+static bool qdisc_bypass;
+static bool csum_offload;
+static unsigned int batch_size = BATCH_SIZE_DEFAULT;
+static char rx_buff[RX_BUFF_LEN];
+static char tx_buff[TX_BUFF_LEN];
+static struct batch_stats rx_stats, tx_stats;
+static unsigned int tx_frames_queued;
+static int iface_mtu = ETH_DATA_LEN;
+
 #if defined(LINUX)
 #define BUFF_LEN 8192
 
+/* 8 blocks of 64 KiB - each one holds ~40 full sized frames */
+#define RX_RING_BLOCK_SIZE (1 << 16)
+#define RX_RING_BLOCK_NR 8
+#define RX_RING_FRAME_SIZE 2048
+/* retire partially filled blocks after 1 ms to keep the TFTP latency low */
+#define RX_RING_BLOCK_TIMEOUT 1
+
+#define TX_RING_BLOCK_SIZE (1 << 16)
+#define TX_RING_BLOCK_NR 4
+#define TX_RING_FRAME_SIZE 2048
+#define TX_RING_FRAME_NR ((TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE) * TX_RING_BLOCK_NR)
+#define TX_RING_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
 struct resp {
 	struct nlmsghdr nh;
 	unsigned char payload[BUFF_LEN];
 };
 
+struct rx_ring {
+	char *map;
+	size_t map_len;
+	unsigned int block_cur;
+};
+
+struct tx_ring {
+	char *map;
+	size_t map_len;
+	unsigned int frame_cur;
+	unsigned int frames_pending;
+};
+
+/* frame buffers for recvmmsg() / sendmmsg() */
+struct mmsg_batch {
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	char *buffs;
+	unsigned int len;
+};
+
 static int raw_sock = -1;
+static int tx_sock = -1;
+static struct rx_ring rx_ring = {
+	.map = MAP_FAILED,
+};
+static struct tx_ring tx_ring = {
+	.map = MAP_FAILED,
+};
+static struct mmsg_batch rx_batch, tx_batch;
+/* virtio_net_hdr in front of every sent frame (checksum offload) */
+static unsigned int vnet_hdr_len;
+
+/* frames go out via the tx socket whenever there is one */
+static int socket_tx_fd(void)
+{
+	return tx_sock >= 0 ? tx_sock : raw_sock;
+}
 
 static int socket_get_all_ifaces(struct resp **resp, unsigned int *len)
 {
@@ -122,10 +202,412 @@ static int socket_get_all_ifaces(struct resp **resp, unsigned int *len)
 out:
 	return ret;
 }
+
+static int socket_rx_ring_setup(void)
+{
+	struct tpacket_req3 req;
+	int ret, version = TPACKET_V3;
+
+	ret = setsockopt(raw_sock, SOL_PACKET, PACKET_VERSION, &version,
+			 sizeof(version));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't enable TPACKET_V3 on raw socket: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RX_RING_BLOCK_SIZE;
+	req.tp_block_nr = RX_RING_BLOCK_NR;
+	req.tp_frame_size = RX_RING_FRAME_SIZE;
+	req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCK_NR;
+	req.tp_retire_blk_tov = RX_RING_BLOCK_TIMEOUT;
+
+	ret = setsockopt(raw_sock, SOL_PACKET, PACKET_RX_RING, &req,
+			 sizeof(req));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't set up rx ring: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	rx_ring.map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	rx_ring.map = mmap(NULL, rx_ring.map_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_LOCKED, raw_sock, 0);
+	if (rx_ring.map == MAP_FAILED) {
+		/* MAP_LOCKED is a best effort optimization only */
+		rx_ring.map = mmap(NULL, rx_ring.map_len,
+				   PROT_READ | PROT_WRITE, MAP_SHARED,
+				   raw_sock, 0);
+	}
+
+	if (rx_ring.map == MAP_FAILED) {
+		fprintf(stderr, "Error - can't map rx ring: %s\n",
+			strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	rx_ring.block_cur = 0;
+	ret = 0;
+
+out:
+	return ret;
+}
+
+static void socket_rx_ring_free(void)
+{
+	if (rx_ring.map == MAP_FAILED)
+		return;
+
+	munmap(rx_ring.map, rx_ring.map_len);
+	rx_ring.map = MAP_FAILED;
+}
+
+/* hand all frames of all blocks retired by the kernel to the handler */
+static int socket_rx_ring_drain(socket_rx_handler handler)
+{
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *hdr;
+	unsigned int i, num_blocks;
+	int num_frames = 0;
+
+	for (num_blocks = 0; num_blocks < RX_RING_BLOCK_NR; num_blocks++) {
+		block = (struct tpacket_block_desc *)(rx_ring.map +
+			rx_ring.block_cur * RX_RING_BLOCK_SIZE);
+
+		if (!(__atomic_load_n(&block->hdr.bh1.block_status,
+				      __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		hdr = (struct tpacket3_hdr *)((char *)block +
+			block->hdr.bh1.offset_to_first_pkt);
+
+		for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+			handler((char *)hdr + hdr->tp_mac, hdr->tp_snaplen);
+			hdr = (struct tpacket3_hdr *)((char *)hdr +
+						      hdr->tp_next_offset);
+		}
+
+		num_frames += block->hdr.bh1.num_pkts;
+
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		rx_ring.block_cur = (rx_ring.block_cur + 1) % RX_RING_BLOCK_NR;
+	}
+
+	return num_frames;
+}
+
+static int socket_qdisc_bypass_set(int sock)
+{
+#if defined(PACKET_QDISC_BYPASS)
+	int ret, val = 1;
+
+	ret = setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &val,
+			 sizeof(val));
+	if (ret < 0)
+		fprintf(stderr, "Error - can't bypass the qdisc layer: %s\n",
+			strerror(errno));
+
+	return ret;
+#else
+	(void)sock;
+	fprintf(stderr, "Error - qdisc bypass not supported by the kernel headers\n");
+	return -1;
+#endif
+}
+
+/* the kernel (or the NIC) fills in checksums of frames marked as such */
+static void socket_vnet_hdr_probe(void)
+{
+#if defined(PACKET_VNET_HDR)
+	int ret, val = 1;
+
+	ret = setsockopt(tx_sock, SOL_PACKET, PACKET_VNET_HDR, &val,
+			 sizeof(val));
+	if (ret == 0) {
+		vnet_hdr_len = sizeof(struct virtio_net_hdr);
+		return;
+	}
+
+	fprintf(stderr, "Warning - checksum offload not supported: %s - computing checksums in software\n",
+		strerror(errno));
+#else
+	fprintf(stderr, "Warning - checksum offload not supported by the kernel headers - computing checksums in software\n");
+#endif
+}
+
+/**
+ * the tx socket does not receive anything (protocol 0) and therefore is
+ * independent of the rx ring version and of the frame format received
+ */
+static int socket_tx_sock_open(int ifindex)
+{
+	struct sockaddr_ll addr;
+	int ret;
+
+	tx_sock = socket(PF_PACKET, SOCK_RAW, 0);
+	if (tx_sock < 0) {
+		fprintf(stderr, "Error - can't create tx socket: %s\n",
+			strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	if (qdisc_bypass) {
+		ret = socket_qdisc_bypass_set(tx_sock);
+		if (ret < 0)
+			goto close_sock;
+	}
+
+	/* has to be enabled before the tx ring is set up */
+	if (csum_offload)
+		socket_vnet_hdr_probe();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = 0;
+	addr.sll_ifindex = ifindex;
+
+	ret = bind(tx_sock, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't bind tx socket: %s\n",
+			strerror(errno));
+		goto close_sock;
+	}
+
+	ret = 0;
+	goto out;
+
+close_sock:
+	close(tx_sock);
+	tx_sock = -1;
+	vnet_hdr_len = 0;
+out:
+	return ret;
+}
+
+static int socket_tx_ring_setup(void)
+{
+	struct tpacket_req req;
+	int ret, version = TPACKET_V2, discard = 1;
+
+	ret = setsockopt(tx_sock, SOL_PACKET, PACKET_VERSION, &version,
+			 sizeof(version));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't enable TPACKET_V2 on tx socket: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	/* skip malformed frames instead of stalling the ring */
+	ret = setsockopt(tx_sock, SOL_PACKET, PACKET_LOSS, &discard,
+			 sizeof(discard));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't set PACKET_LOSS on tx socket: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TX_RING_BLOCK_SIZE;
+	req.tp_block_nr = TX_RING_BLOCK_NR;
+	req.tp_frame_size = TX_RING_FRAME_SIZE;
+	req.tp_frame_nr = TX_RING_FRAME_NR;
+
+	ret = setsockopt(tx_sock, SOL_PACKET, PACKET_TX_RING, &req,
+			 sizeof(req));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't set up tx ring: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	tx_ring.map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	tx_ring.map = mmap(NULL, tx_ring.map_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, tx_sock, 0);
+	if (tx_ring.map == MAP_FAILED) {
+		fprintf(stderr, "Error - can't map tx ring: %s\n",
+			strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	tx_ring.frame_cur = 0;
+	tx_ring.frames_pending = 0;
+	ret = 0;
+
+out:
+	return ret;
+}
+
+static struct tpacket2_hdr *socket_tx_ring_frame(unsigned int frame)
+{
+	return (struct tpacket2_hdr *)(tx_ring.map + frame * TX_RING_FRAME_SIZE);
+}
+
+static void socket_tx_ring_kick(int flags)
+{
+	ssize_t ret;
+
+	/* a blocking kick is also used to wait for frames being sent */
+	if (!tx_ring.frames_pending && (flags & MSG_DONTWAIT))
+		return;
+
+	ret = send(tx_sock, NULL, 0, flags);
+	if ((ret < 0) && (errno != EAGAIN) && (errno != ENOBUFS) &&
+	    (errno != EINTR))
+		fprintf(stderr, "Error - can't flush tx ring: %s\n",
+			strerror(errno));
+
+	tx_ring.frames_pending = 0;
+}
+
+/* returns the data area of the next free slot or NULL if the ring is full */
+static char *socket_tx_ring_slot(void)
+{
+	struct tpacket2_hdr *hdr;
+	unsigned int status;
+
+	hdr = socket_tx_ring_frame(tx_ring.frame_cur);
+	status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+	if (status != TP_STATUS_AVAILABLE) {
+		/* wait until the kernel worked through the queued frames */
+		socket_tx_ring_kick(0);
+		status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	}
+
+	if (status != TP_STATUS_AVAILABLE)
+		return NULL;
+
+	return (char *)hdr + TX_RING_DATA_OFFSET;
+}
+
+static void socket_tx_ring_commit(int len)
+{
+	struct tpacket2_hdr *hdr;
+
+	hdr = socket_tx_ring_frame(tx_ring.frame_cur);
+	hdr->tp_len = len;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+			 __ATOMIC_RELEASE);
+
+	tx_ring.frame_cur = (tx_ring.frame_cur + 1) % TX_RING_FRAME_NR;
+	tx_ring.frames_pending++;
+}
+
+static void socket_tx_ring_free(void)
+{
+	if (tx_ring.map != MAP_FAILED) {
+		socket_tx_ring_kick(MSG_DONTWAIT);
+		munmap(tx_ring.map, tx_ring.map_len);
+		tx_ring.map = MAP_FAILED;
+	}
+
+	if (tx_sock >= 0) {
+		close(tx_sock);
+		tx_sock = -1;
+	}
+
+	vnet_hdr_len = 0;
+}
+
+static int socket_mmsg_batch_init(struct mmsg_batch *batch,
+				  unsigned int buff_len)
+{
+	unsigned int i;
+
+	batch->msgs = calloc(batch_size, sizeof(*batch->msgs));
+	batch->iovs = calloc(batch_size, sizeof(*batch->iovs));
+	batch->buffs = malloc((size_t)batch_size * buff_len);
+	batch->len = 0;
+
+	if (!batch->msgs || !batch->iovs || !batch->buffs) {
+		fprintf(stderr, "Error - can't allocate frame batch\n");
+		return -1;
+	}
+
+	for (i = 0; i < batch_size; i++) {
+		batch->iovs[i].iov_base = batch->buffs + i * buff_len;
+		batch->iovs[i].iov_len = buff_len;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return 0;
+}
+
+static void socket_mmsg_batch_free(struct mmsg_batch *batch)
+{
+	free(batch->msgs);
+	free(batch->iovs);
+	free(batch->buffs);
+	memset(batch, 0, sizeof(*batch));
+}
+
+static int socket_mmsg_read(socket_rx_handler handler)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < batch_size; i++)
+		rx_batch.iovs[i].iov_len = RX_BUFF_LEN;
+
+	ret = recvmmsg(raw_sock, rx_batch.msgs, batch_size, MSG_DONTWAIT,
+		       NULL);
+	if (ret < 0) {
+		if ((errno != EWOULDBLOCK) && (errno != EINTR))
+			fprintf(stderr, "Error reading data from network: %s",
+				strerror(errno));
+		return ret;
+	}
+
+	for (i = 0; i < (unsigned int)ret; i++)
+		handler(rx_batch.iovs[i].iov_base, rx_batch.msgs[i].msg_len);
+
+	return ret;
+}
+
+static void socket_mmsg_flush(void)
+{
+	unsigned int sent = 0;
+	int ret;
+
+	while (sent < tx_batch.len) {
+		ret = sendmmsg(socket_tx_fd(), tx_batch.msgs + sent,
+			       tx_batch.len - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr,
+				"Error - can't write to raw socket: %s\n",
+				strerror(errno));
+			break;
+		}
+
+		sent += ret;
+	}
+
+	tx_batch.len = 0;
+}
 #elif USE_PCAP
 pcap_t *pcap_fp = NULL;
 #endif
 
+static void socket_stats_add(struct batch_stats *stats, unsigned int frames)
+{
+	if (frames == 0)
+		return;
+
+	stats->batches++;
+	stats->frames += frames;
+	if (frames > stats->max)
+		stats->max = frames;
+}
+
 char *socket_find_iface_by_index(const char *iface_number)
 {
 #if defined(LINUX)
@@ -321,6 +803,88 @@ void socket_print_all_ifaces(void)
 #endif
 }
 
+int socket_set_rx_mode(const char *mode)
+{
+	if (strcmp(mode, "read") == 0) {
+		rx_mode = SOCKET_RX_MODE_READ;
+		return 0;
+	}
+
+#if defined(LINUX)
+	if (strcmp(mode, "ring") == 0) {
+		rx_mode = SOCKET_RX_MODE_RING;
+		return 0;
+	}
+
+	if (strcmp(mode, "mmsg") == 0) {
+		rx_mode = SOCKET_RX_MODE_MMSG;
+		return 0;
+	}
+#endif
+
+	fprintf(stderr, "Error - unsupported receive mode: %s\n", mode);
+	return -1;
+}
+
+int socket_set_tx_mode(const char *mode)
+{
+	if (strcmp(mode, "write") == 0) {
+		tx_mode = SOCKET_TX_MODE_WRITE;
+		return 0;
+	}
+
+#if defined(LINUX)
+	if (strcmp(mode, "ring") == 0) {
+		tx_mode = SOCKET_TX_MODE_RING;
+		return 0;
+	}
+
+	if (strcmp(mode, "mmsg") == 0) {
+		tx_mode = SOCKET_TX_MODE_MMSG;
+		return 0;
+	}
+#endif
+
+	fprintf(stderr, "Error - unsupported transmit mode: %s\n", mode);
+	return -1;
+}
+
+void socket_set_qdisc_bypass(bool bypass)
+{
+	qdisc_bypass = bypass;
+}
+
+void socket_set_csum_offload(bool offload)
+{
+	csum_offload = offload;
+}
+
+/* UDP and TCP checksums are left to the kernel / NIC */
+bool socket_csum_offload(void)
+{
+#if defined(LINUX)
+	return vnet_hdr_len != 0;
+#else
+	return false;
+#endif
+}
+
+int socket_set_batch_size(const char *size)
+{
+	long val;
+	char *end;
+
+	val = strtol(size, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > BATCH_SIZE_MAX)) {
+		fprintf(stderr, "Error - batch size has to be between 1 and %d: %s\n",
+			BATCH_SIZE_MAX, size);
+		return -1;
+	}
+
+	batch_size = val;
+	return 0;
+}
+
 int socket_open(const char *iface)
 {
 #if defined(LINUX)
@@ -376,6 +940,17 @@ int socket_open(const char *iface)
 		goto close_sock;
 	}
 
+	ret = ioctl(raw_sock, SIOCGIFMTU, &req);
+
+	if (ret < 0) {
+		fprintf(stderr,
+			"Error - can't get interface mtu (SIOCGIFMTU): %s\n",
+			strerror(errno));
+		goto close_sock;
+	}
+
+	iface_mtu = req.ifr_mtu;
+
 	ret = ioctl(raw_sock, SIOCGIFINDEX, &req);
 
 	if (ret < 0) {
@@ -385,6 +960,13 @@ int socket_open(const char *iface)
 		goto close_sock;
 	}
 
+	if (rx_mode == SOCKET_RX_MODE_RING) {
+		ret = socket_rx_ring_setup();
+		if (ret < 0)
+			goto close_sock;
+	}
+
+	memset(&addr, 0, sizeof(addr));
 	addr.sll_family = AF_PACKET;
 	addr.sll_protocol = htons(ETH_P_ALL);
 	addr.sll_ifindex = req.ifr_ifindex;
@@ -396,6 +978,36 @@ int socket_open(const char *iface)
 		goto close_sock;
 	}
 
+	if (rx_mode == SOCKET_RX_MODE_MMSG) {
+		ret = socket_mmsg_batch_init(&rx_batch, RX_BUFF_LEN);
+		if (ret < 0)
+			goto close_sock;
+	}
+
+	if (tx_mode == SOCKET_TX_MODE_MMSG) {
+		ret = socket_mmsg_batch_init(&tx_batch, TX_BUFF_LEN +
+					     sizeof(struct virtio_net_hdr));
+		if (ret < 0)
+			goto close_sock;
+	}
+
+	/* sent frames with a virtio_net_hdr must not change the received ones */
+	if ((tx_mode == SOCKET_TX_MODE_RING) || csum_offload) {
+		ret = socket_tx_sock_open(req.ifr_ifindex);
+		if (ret < 0)
+			goto close_sock;
+	}
+
+	if (tx_mode == SOCKET_TX_MODE_RING) {
+		ret = socket_tx_ring_setup();
+		if (ret < 0)
+			goto close_sock;
+	} else if (qdisc_bypass && (tx_sock < 0)) {
+		ret = socket_qdisc_bypass_set(raw_sock);
+		if (ret < 0)
+			goto close_sock;
+	}
+
 	sock_opts = fcntl(raw_sock, F_GETFL, 0);
 	if (sock_opts == -1) {
 		fprintf(stderr, "Error - can't read socket flags: %s\n",
@@ -413,6 +1025,10 @@ int socket_open(const char *iface)
 	return 0;
 
 close_sock:
+	socket_mmsg_batch_free(&tx_batch);
+	socket_mmsg_batch_free(&rx_batch);
+	socket_tx_ring_free();
+	socket_rx_ring_free();
 	close(raw_sock);
 	raw_sock = -1;
 out:
@@ -485,14 +1101,7 @@ int socket_open(const char *iface)
 #endif
 }
 
-#if defined(USE_PCAP)
-int socket_read(char *packet_buff, int packet_buff_len,
-		int (*sleep_sec)__attribute__((unused)),
-		int (*sleep_usec)__attribute__((unused)))
-#else
-int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
-		int *sleep_usec)
-#endif
+int socket_read(socket_rx_handler handler, int *sleep_sec, int *sleep_usec)
 {
 #if defined(LINUX)
 	struct timeval tv;
@@ -506,6 +1115,13 @@ int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
 		goto out;
 	}
 
+	/* blocks retired while the last batch was processed */
+	if (rx_mode == SOCKET_RX_MODE_RING) {
+		ret = socket_rx_ring_drain(handler);
+		if (ret > 0)
+			goto out;
+	}
+
 	FD_ZERO(&watched_fds);
 	FD_SET(raw_sock, &watched_fds);
 
@@ -527,7 +1143,18 @@ int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
 	if (ret <= 0)
 		goto out;
 
-	read_len = read(raw_sock, packet_buff, packet_buff_len);
+	switch (rx_mode) {
+	case SOCKET_RX_MODE_RING:
+		ret = socket_rx_ring_drain(handler);
+		goto out;
+	case SOCKET_RX_MODE_MMSG:
+		ret = socket_mmsg_read(handler);
+		goto out;
+	case SOCKET_RX_MODE_READ:
+		break;
+	}
+
+	read_len = read(raw_sock, rx_buff, sizeof(rx_buff) - 1);
 
 	if (read_len < 0) {
 		if ((errno != EWOULDBLOCK) && (errno != EINTR))
@@ -537,10 +1164,16 @@ int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
 
 	ret = (int)read_len;
 
-	if (read_len > 0)
-		packet_buff[read_len] = '\0';
+	if (read_len > 0) {
+		rx_buff[read_len] = '\0';
+		handler(rx_buff, (int)read_len);
+		ret = 1;
+	}
 
 out:
+	if (ret > 0)
+		socket_stats_add(&rx_stats, ret);
+
 	return ret;
 #elif USE_PCAP
 
@@ -548,6 +1181,9 @@ int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
 	const unsigned char *tmp_packet;
 	int ret = -1;
 
+	(void)sleep_sec;
+	(void)sleep_usec;
+
 	if (!pcap_fp) {
 		fprintf(stderr,
 			"Error reading from network: pcap socket not initialized yet\n");
@@ -559,10 +1195,13 @@ int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
 
 	if ((tmp_packet) && (hdr.len > 0)) {
 		ret = hdr.len;
-		if (ret > packet_buff_len)
-			ret = packet_buff_len;
-		memcpy(packet_buff, tmp_packet, ret);
-		packet_buff[ret] = '\0';
+		if (ret > (int)sizeof(rx_buff) - 1)
+			ret = sizeof(rx_buff) - 1;
+		memcpy(rx_buff, tmp_packet, ret);
+		rx_buff[ret] = '\0';
+		handler(rx_buff, ret);
+		socket_stats_add(&rx_stats, 1);
+		ret = 1;
 	}
 out:
 	return ret;
@@ -572,10 +1211,181 @@ int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
 #endif
 }
 
-int socket_write(const char *buff, int len)
+/**
+ * socket_fd() - file descriptor that becomes readable when frames arrive
+ *
+ * Return: the raw socket, -1 if the platform has no pollable descriptor
+ */
+int socket_fd(void)
+{
+#if defined(LINUX)
+	return raw_sock;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * socket_drain() - pass all frames waiting in the socket to @handler
+ * @handler: called for every received frame
+ *
+ * Never blocks. At most SOCKET_DRAIN_MAX frames are handled per call so
+ * that a busy link can't hold off the caller's timers.
+ *
+ * Return: number of frames handled
+ */
+int socket_drain(socket_rx_handler handler)
+{
+#if defined(LINUX)
+	ssize_t read_len;
+	int ret, num_frames = 0;
+
+	switch (rx_mode) {
+	case SOCKET_RX_MODE_RING:
+		num_frames = socket_rx_ring_drain(handler);
+		break;
+	case SOCKET_RX_MODE_MMSG:
+		while (num_frames < SOCKET_DRAIN_MAX) {
+			ret = socket_mmsg_read(handler);
+			if (ret <= 0)
+				break;
+
+			num_frames += ret;
+			if (ret < (int)batch_size)
+				break;
+		}
+		break;
+	case SOCKET_RX_MODE_READ:
+		while (num_frames < SOCKET_DRAIN_MAX) {
+			read_len = recv(raw_sock, rx_buff, sizeof(rx_buff) - 1,
+					MSG_DONTWAIT);
+			if (read_len < 0) {
+				if ((errno != EWOULDBLOCK) && (errno != EINTR))
+					fprintf(stderr, "Error reading data from network: %s",
+						strerror(errno));
+				break;
+			}
+
+			if (read_len == 0)
+				break;
+
+			rx_buff[read_len] = '\0';
+			handler(rx_buff, (int)read_len);
+			num_frames++;
+		}
+		break;
+	}
+
+	socket_stats_add(&rx_stats, num_frames);
+	return num_frames;
+#else
+	(void)handler;
+	return 0;
+#endif
+}
+
+/**
+ * socket_mtu - largest IP packet which fits into a single outgoing frame
+ *
+ * This is the mtu of the interface but never more than the frame buffers
+ * can hold.
+ */
+int socket_mtu(void)
+{
+	if (iface_mtu > TX_BUFF_LEN - ETH_HLEN)
+		return TX_BUFF_LEN - ETH_HLEN;
+
+	return iface_mtu;
+}
+
+/**
+ * socket_tx_buff_get - buffer to build the next outgoing frame in
+ *
+ * In ring and mmsg mode this is the next free tx ring slot / batch buffer
+ * which lets socket_write() queue the frame without copying it.
+ */
+char *socket_tx_buff_get(void)
+{
+#if defined(LINUX)
+	char *slot;
+
+	switch (tx_mode) {
+	case SOCKET_TX_MODE_RING:
+		slot = socket_tx_ring_slot();
+		if (!slot)
+			return tx_buff;
+
+		return slot + vnet_hdr_len;
+	case SOCKET_TX_MODE_MMSG:
+		if (tx_batch.len == batch_size)
+			socket_mmsg_flush();
+
+		return (char *)tx_batch.iovs[tx_batch.len].iov_base + vnet_hdr_len;
+	case SOCKET_TX_MODE_WRITE:
+		break;
+	}
+
+	return tx_buff;
+#else
+	return tx_buff;
+#endif
+}
+
+#if defined(LINUX)
+static void socket_vnet_hdr_set(char *buff, int csum_start, int csum_offset)
+{
+	struct virtio_net_hdr *vnet_hdr = (struct virtio_net_hdr *)buff;
+
+	memset(vnet_hdr, 0, sizeof(*vnet_hdr));
+	vnet_hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+	if (csum_start <= 0)
+		return;
+
+	vnet_hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vnet_hdr->csum_start = csum_start;
+	vnet_hdr->csum_offset = csum_offset;
+}
+
+/* what the kernel does for frames the NIC can't checksum */
+static void socket_csum_fill(char *buff, int len, int csum_start,
+			     int csum_offset)
+{
+	const unsigned char *data = (const unsigned char *)buff;
+	uint32_t sum = 0;
+	uint16_t check;
+	int i;
+
+	for (i = csum_start; i + 1 < len; i += 2)
+		sum += (data[i] << 8) | data[i + 1];
+
+	if (i < len)
+		sum += data[i] << 8;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	check = htons(~sum);
+	memcpy(buff + csum_start + csum_offset, &check, sizeof(check));
+}
+#endif
+
+/**
+ * socket_write_csum - send a frame with a pending transport checksum
+ * @csum_start: offset of the transport header - 0 if there is none
+ * @csum_offset: offset of the checksum field within the transport header
+ *
+ * With checksum offload (see socket_csum_offload()) the checksum field has
+ * to hold the sum of the pseudo header, otherwise the complete checksum.
+ */
+int socket_write_csum(const char *buff, int len, int csum_start,
+		      int csum_offset)
 {
 #if defined(LINUX)
+	struct virtio_net_hdr vnet_hdr;
+	struct iovec iov[2];
 	int ret = -1;
+	char *slot;
 
 	if (raw_sock < 0) {
 		fprintf(stderr,
@@ -583,7 +1393,64 @@ int socket_write(const char *buff, int len)
 		goto out;
 	}
 
-	ret = write(raw_sock, buff, len);
+	if ((tx_mode == SOCKET_TX_MODE_RING) &&
+	    (len <= TX_RING_FRAME_SIZE - (int)TX_RING_DATA_OFFSET - (int)vnet_hdr_len)) {
+		slot = socket_tx_ring_slot();
+		if (!slot)
+			goto write;
+
+		/* frame was built in place (see socket_tx_buff_get()) */
+		if (slot + vnet_hdr_len != buff)
+			memcpy(slot + vnet_hdr_len, buff, len);
+
+		if (vnet_hdr_len)
+			socket_vnet_hdr_set(slot, csum_start, csum_offset);
+
+		socket_tx_ring_commit(len + vnet_hdr_len);
+		ret = len;
+		goto out;
+	}
+
+	if ((tx_mode == SOCKET_TX_MODE_MMSG) && (len <= TX_BUFF_LEN)) {
+		if (tx_batch.len == batch_size)
+			socket_mmsg_flush();
+
+		slot = tx_batch.iovs[tx_batch.len].iov_base;
+		if (slot + vnet_hdr_len != buff)
+			memcpy(slot + vnet_hdr_len, buff, len);
+
+		if (vnet_hdr_len)
+			socket_vnet_hdr_set(slot, csum_start, csum_offset);
+
+		tx_batch.iovs[tx_batch.len].iov_len = len + vnet_hdr_len;
+		tx_batch.len++;
+		ret = len;
+		goto out;
+	}
+
+write:
+	if (vnet_hdr_len && (tx_mode != SOCKET_TX_MODE_RING)) {
+		socket_vnet_hdr_set((char *)&vnet_hdr, csum_start, csum_offset);
+		iov[0].iov_base = &vnet_hdr;
+		iov[0].iov_len = vnet_hdr_len;
+		iov[1].iov_base = (void *)buff;
+		iov[1].iov_len = len;
+
+		ret = writev(tx_sock, iov, 2);
+		if (ret > 0)
+			ret -= vnet_hdr_len;
+	} else {
+		/* the tx ring is full - the raw socket has no virtio_net_hdr */
+		if (vnet_hdr_len && (csum_start > 0) && (len <= TX_BUFF_LEN)) {
+			if (buff != tx_buff)
+				memcpy(tx_buff, buff, len);
+
+			socket_csum_fill(tx_buff, len, csum_start, csum_offset);
+			buff = tx_buff;
+		}
+
+		ret = write(raw_sock, buff, len);
+	}
 
 	if (ret < 0)
 		fprintf(stderr,
@@ -591,10 +1458,17 @@ int socket_write(const char *buff, int len)
 			strerror(errno));
 
 out:
+	if (ret > 0)
+		tx_frames_queued++;
+
 	return ret;
 #elif USE_PCAP
 	int ret = -1;
 
+	/* checksums are always computed in software */
+	(void)csum_start;
+	(void)csum_offset;
+
 	if (!pcap_fp) {
 		fprintf(stderr,
 			"Error writing to network: pcap socket not initialized yet\n");
@@ -605,6 +1479,8 @@ int socket_write(const char *buff, int len)
 
 	if (ret < 0)
 		fprintf(stderr, "Error - can't write to pcap socket\n");
+	else
+		tx_frames_queued++;
 
 out:
 	return ret;
@@ -614,6 +1490,79 @@ int socket_write(const char *buff, int len)
 #endif
 }
 
+int socket_write(const char *buff, int len)
+{
+	return socket_write_csum(buff, len, 0, 0);
+}
+
+/**
+ * socket_filter_attach() - replace the kernel filter of the receive socket
+ * @prog: classic BPF program deciding which frames reach socket_read()
+ *
+ * Return: 0 when the filter was attached or filtering is not supported on
+ * this platform, -1 on error (frames keep being filtered in userspace).
+ */
+int socket_filter_attach(const struct sock_fprog *prog)
+{
+#if defined(LINUX)
+	int ret;
+
+	if (raw_sock < 0)
+		return -1;
+
+	ret = setsockopt(raw_sock, SOL_SOCKET, SO_ATTACH_FILTER, prog,
+			 sizeof(*prog));
+	if (ret < 0) {
+		fprintf(stderr, "Error - can't attach socket filter: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	return 0;
+#endif
+}
+
+/* hand all frames queued since the last call over to the kernel */
+void socket_flush(void)
+{
+#if defined(LINUX)
+	switch (tx_mode) {
+	case SOCKET_TX_MODE_RING:
+		socket_tx_ring_kick(MSG_DONTWAIT);
+		break;
+	case SOCKET_TX_MODE_MMSG:
+		socket_mmsg_flush();
+		break;
+	case SOCKET_TX_MODE_WRITE:
+		break;
+	}
+#endif
+
+	socket_stats_add(&tx_stats, tx_frames_queued);
+	tx_frames_queued = 0;
+}
+
+static void socket_print_batch_stats(const char *desc,
+				     const struct batch_stats *stats)
+{
+	unsigned long avg_x10 = 0;
+
+	if (stats->batches)
+		avg_x10 = (stats->frames * 10) / stats->batches;
+
+	fprintf(stderr, "%s: %lu frames in %lu batches (avg: %lu.%lu, max: %u)\n",
+		desc, stats->frames, stats->batches, avg_x10 / 10, avg_x10 % 10,
+		stats->max);
+}
+
+void socket_print_stats(void)
+{
+	socket_print_batch_stats("Received", &rx_stats);
+	socket_print_batch_stats("Sent", &tx_stats);
+}
+
 void socket_close(const char *iface)
 {
 #if defined(LINUX)
@@ -647,6 +1596,11 @@ void socket_close(const char *iface)
 	}
 
 close_sock:
+	socket_mmsg_flush();
+	socket_mmsg_batch_free(&tx_batch);
+	socket_mmsg_batch_free(&rx_batch);
+	socket_tx_ring_free();
+	socket_rx_ring_free();
 	close(raw_sock);
 	raw_sock = -1;
 out:
@@ -22,12 +22,50 @@
 #ifndef __AP51_FLASH_SOCKET_H__
 #define __AP51_FLASH_SOCKET_H__
 
+#include <stdbool.h>
+
+struct sock_fprog;
+
+enum socket_rx_mode {
+	SOCKET_RX_MODE_READ,
+	SOCKET_RX_MODE_RING,
+	SOCKET_RX_MODE_MMSG,
+};
+
+enum socket_tx_mode {
+	SOCKET_TX_MODE_WRITE,
+	SOCKET_TX_MODE_RING,
+	SOCKET_TX_MODE_MMSG,
+};
+
+/**
+ * socket_rx_handler - called by socket_read() and socket_drain() per frame
+ *
+ * The frame may live in memory shared with the kernel (rx ring) and must
+ * not be accessed after the handler returned. It is not zero terminated.
+ */
+typedef void (*socket_rx_handler)(char *packet_buff, int packet_buff_len);
+
 void socket_print_all_ifaces(void);
 char *socket_find_iface_by_index(const char *iface_number);
+int socket_set_rx_mode(const char *mode);
+int socket_set_tx_mode(const char *mode);
+void socket_set_qdisc_bypass(bool bypass);
+void socket_set_csum_offload(bool offload);
+bool socket_csum_offload(void);
+int socket_set_batch_size(const char *batch_size);
 int socket_open(const char *iface);
-int socket_read(char *packet_buff, int packet_buff_len, int *sleep_sec,
-		int *sleep_usec);
+int socket_fd(void);
+int socket_drain(socket_rx_handler handler);
+int socket_read(socket_rx_handler handler, int *sleep_sec, int *sleep_usec);
+int socket_mtu(void);
+char *socket_tx_buff_get(void);
 int socket_write(const char *buff, int len);
+int socket_write_csum(const char *buff, int len, int csum_start,
+		      int csum_offset);
+int socket_filter_attach(const struct sock_fprog *prog);
+void socket_flush(void);
+void socket_print_stats(void);
 void socket_close(const char *iface);
 
 #endif /* __AP51_FLASH_SOCKET_H__ */
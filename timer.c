@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) Marek Lindner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ * License-Filename: LICENSES/preferred/GPL-3.0
+ */
+
+#include "timer.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "compat.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*
+ * Hierarchical timer wheel with a resolution of 1ms. Level 0 holds the
+ * timers expiring within the next WHEEL_SLOTS ms, each higher level covers
+ * WHEEL_SLOTS times the range of the level below. Timers of higher levels
+ * are cascaded down once the wheel reaches their slot, therefore adding,
+ * deleting and expiring a timer is O(1) no matter how many are pending.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+static struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+/* next ms the wheel has to process */
+static uint64_t wheel_now;
+static unsigned int timers_pending;
+
+/* monotonic clock in ms */
+uint64_t timer_now(void)
+{
+#if defined(WIN32)
+	return GetTickCount64();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void timer_wheel_init(void)
+{
+	memset(wheel, 0, sizeof(wheel));
+	wheel_now = timer_now();
+	timers_pending = 0;
+}
+
+void timer_init(struct timer *timer, void (*func)(void *data), void *data)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->func = func;
+	timer->data = data;
+}
+
+static void timer_slot_add(struct timer **slot, struct timer *timer)
+{
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+
+	*slot = timer;
+	timer->pprev = slot;
+}
+
+static void timer_insert(struct timer *timer)
+{
+	unsigned int level, shift = 0;
+	uint64_t diff;
+
+	if (timer->expires < wheel_now)
+		timer->expires = wheel_now;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = level * WHEEL_BITS;
+		diff = (timer->expires >> shift) - (wheel_now >> shift);
+		if (diff < WHEEL_SLOTS)
+			break;
+	}
+
+	/* beyond the range of the wheel: expire (too) early at its end */
+	if (level == WHEEL_LEVELS) {
+		level = WHEEL_LEVELS - 1;
+		timer->expires = ((wheel_now >> shift) + WHEEL_MASK) << shift;
+	}
+
+	timer_slot_add(&wheel[level][(timer->expires >> shift) & WHEEL_MASK],
+		       timer);
+}
+
+void timer_del(struct timer *timer)
+{
+	if (!timer_pending(timer))
+		return;
+
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timers_pending--;
+}
+
+/**
+ * timer_add() - (re-)arm a timer
+ * @timer: initialized timer, may already be pending
+ * @timeout: ms from now until the timer expires
+ */
+void timer_add(struct timer *timer, unsigned int timeout)
+{
+	timer_del(timer);
+
+	timer->expires = timer_now() + timeout;
+	timer_insert(timer);
+	timers_pending++;
+}
+
+static void timer_cascade(unsigned int level, unsigned int index)
+{
+	struct timer *timer, *next;
+
+	timer = wheel[level][index];
+	wheel[level][index] = NULL;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+		timer_insert(timer);
+	}
+}
+
+static void timer_tick(void)
+{
+	struct timer *expired, *timer;
+	unsigned int level;
+	uint64_t tick = wheel_now;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (tick & (((uint64_t)1 << (level * WHEEL_BITS)) - 1))
+			break;
+	}
+
+	while (--level > 0)
+		timer_cascade(level, (tick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+
+	/* callbacks re-arming their timer must not land in this slot again */
+	expired = wheel[0][tick & WHEEL_MASK];
+	wheel[0][tick & WHEEL_MASK] = NULL;
+	if (expired)
+		expired->pprev = &expired;
+
+	wheel_now = tick + 1;
+
+	while (expired) {
+		timer = expired;
+		timer_del(timer);
+		timer->func(timer->data);
+	}
+}
+
+/* call the handler of every timer which expired by now */
+void timer_run(void)
+{
+	uint64_t now = timer_now();
+
+	while (wheel_now <= now) {
+		if (!timers_pending) {
+			wheel_now = now + 1;
+			break;
+		}
+
+		timer_tick();
+	}
+}
+
+/**
+ * timer_next() - time at which timer_run() has to be called next
+ *
+ * This is either the deadline of the next timer or the point at which the
+ * next batch of long running timers has to be cascaded.
+ *
+ * Return: absolute time in ms, TIMER_NONE if no timer is pending
+ */
+uint64_t timer_next(void)
+{
+	uint64_t next = TIMER_NONE, index;
+	unsigned int level, shift, i;
+
+	if (!timers_pending)
+		return TIMER_NONE;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = level * WHEEL_BITS;
+		index = wheel_now >> shift;
+
+		for (i = 0; i < WHEEL_SLOTS; i++) {
+			if (!wheel[level][(index + i) & WHEEL_MASK])
+				continue;
+
+			if (((index + i) << shift) < next)
+				next = (index + i) << shift;
+			break;
+		}
+	}
+
+	if (next < wheel_now)
+		next = wheel_now;
+
+	return next;
+}
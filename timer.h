@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) Marek Lindner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ * License-Filename: LICENSES/preferred/GPL-3.0
+ */
+
+#ifndef __AP51_FLASH_TIMER_H__
+#define __AP51_FLASH_TIMER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_NONE UINT64_MAX
+
+/**
+ * struct timer - deadline registered in the timer wheel
+ * @next: next timer in the same wheel slot
+ * @pprev: pointer to the pointer referencing this timer, NULL if not pending
+ * @expires: absolute deadline in ms (see timer_now())
+ * @func: called once the deadline has passed
+ * @data: argument passed to @func
+ */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	uint64_t expires;
+	void (*func)(void *data);
+	void *data;
+};
+
+uint64_t timer_now(void);
+void timer_wheel_init(void);
+void timer_init(struct timer *timer, void (*func)(void *data), void *data);
+void timer_add(struct timer *timer, unsigned int timeout);
+void timer_del(struct timer *timer);
+uint64_t timer_next(void);
+void timer_run(void);
+
+static inline int timer_pending(const struct timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+#endif /* __AP51_FLASH_TIMER_H__ */